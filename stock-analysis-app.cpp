@@ -1,543 +1,5697 @@
 #include <iostream>
 #include <curl/curl.h>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <stack>
+#include <queue>
+#include <deque>
+#include <list>
 #include <vector>
-#include <sstream>
 #include <map>
 #include <cmath>
 #include <fstream>
 #include <random>
 #include <algorithm>
+#include <numeric>
 #include <iomanip>
 #include <chrono>
 #include <thread>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <limits>
+#include <cstdio>
+#include <ctime>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <sys/stat.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STOCK_ANALYZER_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define STOCK_ANALYZER_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#endif
 
-// Write callback function for libcurl
-size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* s) {
-    size_t newLength = size * nmemb;
-    s->append((char*)contents, newLength);
-    return newLength;
+// Convert a YYYY-MM-DD date to days since 1970-01-01
+bool parseDate(std::string_view text, int& day) {
+    int y = 0, m = 0, d = 0;
+    if (text.size() != 10 || text[4] != '-' || text[7] != '-' ||
+        std::from_chars(text.data(), text.data() + 4, y).ptr != text.data() + 4 ||
+        std::from_chars(text.data() + 5, text.data() + 7, m).ptr != text.data() + 7 ||
+        std::from_chars(text.data() + 8, text.data() + 10, d).ptr != text.data() + 10) {
+        return false;
+    }
+    if (m < 1 || m > 12 || d < 1 || d > 31) return false;
+    
+    // Days-from-civil over a March-based year
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    day = era * 146097 + doe - 719468;
+    return true;
 }
 
-// Function to fetch data from API
-std::string fetchData(const std::string& url) {
-    CURL* curl;
-    CURLcode res;
-    std::string readBuffer;
+// Convert days since 1970-01-01 back to YYYY-MM-DD
+std::string formatDate(int day) {
+    int z = day + 719468;
+    int era = (z >= 0 ? z : z - 146096) / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    int d = doy - (153 * mp + 2) / 5 + 1;
+    int m = mp < 10 ? mp + 3 : mp - 9;
+    int y = yoe + era * 400 + (m <= 2);
+    
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%04d-%02d-%02d", y, m, d);
+    return buffer;
+}
 
-    curl = curl_easy_init();
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-        res = curl_easy_perform(curl);
-        curl_easy_cleanup(curl);
+// Today's date as days since 1970-01-01 (UTC)
+int currentDay() {
+    return static_cast<int>(std::time(nullptr) / 86400);
+}
 
-        if (res != CURLE_OK) {
-            std::cerr << "CURL error: " << curl_easy_strerror(res) << std::endl;
-        }
-    }
-    return readBuffer;
+// Most recent weekday strictly before the given day
+int previousWeekday(int day) {
+    do {
+        day--;
+    } while ((day + 4) % 7 == 0 || (day + 4) % 7 == 6); // 1970-01-01 was a Thursday
+    return day;
 }
 
-// Parse CSV data to extract prices
-std::vector<double> parsePrices(const std::string& data) {
+// Inclusive range of days since 1970-01-01
+struct DateRange {
+    int first;
+    int last;
+    
+    // Unbounded on both sides
+    static DateRange all() {
+        return DateRange{std::numeric_limits<int>::min(), std::numeric_limits<int>::max()};
+    }
+    
+    bool contains(int day) const {
+        return day >= first && day <= last;
+    }
+};
+
+// Daily adjusted closes with their dates, in chronological order
+struct PriceSeries {
+    std::vector<int> dates;
     std::vector<double> prices;
-    std::istringstream iss(data);
-    std::string line;
+    
+    bool empty() const {
+        return prices.empty();
+    }
+    
+    int lastDate() const {
+        return dates.back();
+    }
+};
 
-    // Skip header
-    std::getline(iss, line);
+// Copy out the bars that fall inside a date range
+PriceSeries sliceSeries(const PriceSeries& series, const DateRange& range) {
+    size_t lo = std::lower_bound(series.dates.begin(), series.dates.end(), range.first) - series.dates.begin();
+    size_t hi = std::upper_bound(series.dates.begin(), series.dates.end(), range.last) - series.dates.begin();
+    PriceSeries slice;
+    if (lo < hi) {
+        slice.dates.assign(series.dates.begin() + lo, series.dates.begin() + hi);
+        slice.prices.assign(series.prices.begin() + lo, series.prices.begin() + hi);
+    }
+    return slice;
+}
 
-    while (std::getline(iss, line)) {
-        std::istringstream lineStream(line);
-        std::string date, open, high, low, close, adjustedClose, volume, dividend, splitCoefficient;
-        
-        std::getline(lineStream, date, ',');
-        std::getline(lineStream, open, ',');
-        std::getline(lineStream, high, ',');
-        std::getline(lineStream, low, ',');
-        std::getline(lineStream, close, ',');
-        std::getline(lineStream, adjustedClose, ',');
-        
-        try {
-            prices.push_back(std::stod(adjustedClose));
-        } catch (const std::exception& e) {
-            std::cerr << "Error converting price: " << adjustedClose << " - " << e.what() << std::endl;
+// Process-wide counters and per-stage timers. Every update is a relaxed
+// atomic add, so instrumentation stays on in production runs. Stage times
+// are wall time and process CPU time (all threads) while the stage ran;
+// stages that overlap, like fetching and computing, each see the shared CPU.
+class Metrics {
+public:
+    enum Counter {
+        REQUESTS,
+        BYTES_DOWNLOADED,
+        TRANSFER_ERRORS,
+        UNEXPECTED_RESPONSES,
+        RETRIES,
+        THROTTLED_RESPONSES,
+        CACHE_HITS,
+        ROWS_PARSED,
+        PARSE_ERRORS,
+        STOCKS_ANALYZED,
+        STOCKS_SKIPPED,
+        COUNTER_COUNT
+    };
+    
+    enum Stage {
+        LOAD,
+        FETCH_MARKET,
+        FETCH_STOCKS,
+        RATE_LIMIT_WAIT,
+        COMPUTE,
+        CACHE_FLUSH,
+        BOOTSTRAP,
+        EXPORT,
+        STAGE_COUNT
+    };
+    
+private:
+    struct StageTotals {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> wallNanoseconds{0};
+        std::atomic<uint64_t> cpuNanoseconds{0};
+    };
+    
+    std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    StageTotals stages[STAGE_COUNT];
+    
+    static const char* counterName(int counter) {
+        static const char* names[COUNTER_COUNT] = {
+            "requests", "bytes_downloaded", "transfer_errors", "unexpected_responses", "retries",
+            "throttled_responses", "cache_hits", "rows_parsed", "parse_errors", "stocks_analyzed", "stocks_skipped"};
+        return names[counter];
+    }
+    
+    static const char* stageName(int stage) {
+        static const char* names[STAGE_COUNT] = {
+            "load", "fetch_market", "fetch_stocks", "rate_limit_wait", "compute", "cache_flush", "bootstrap", "export"};
+        return names[stage];
+    }
+    
+    static double seconds(const std::atomic<uint64_t>& nanoseconds) {
+        return nanoseconds.load(std::memory_order_relaxed) * 1e-9;
+    }
+    
+public:
+    void add(Counter counter, uint64_t amount = 1) {
+        counters[counter].fetch_add(amount, std::memory_order_relaxed);
+    }
+    
+    void record(Stage stage, uint64_t wallNanoseconds, uint64_t cpuNanoseconds) {
+        StageTotals& totals = stages[stage];
+        totals.calls.fetch_add(1, std::memory_order_relaxed);
+        totals.wallNanoseconds.fetch_add(wallNanoseconds, std::memory_order_relaxed);
+        totals.cpuNanoseconds.fetch_add(cpuNanoseconds, std::memory_order_relaxed);
+    }
+    
+    // Human-readable summary of the stages that ran and the non-zero counters
+    void printSummary(std::ostream& out) const {
+        out << "===== Run Metrics =====\n";
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            const StageTotals& totals = stages[stage];
+            uint64_t calls = totals.calls.load(std::memory_order_relaxed);
+            if (calls == 0) continue;
+            out << std::left << std::setw(16) << stageName(stage) << std::right << std::fixed << std::setprecision(3)
+                << std::setw(10) << seconds(totals.wallNanoseconds) << " s wall" << std::setw(10)
+                << seconds(totals.cpuNanoseconds) << " s cpu  (" << calls << "x)\n";
+        }
+        for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+            uint64_t value = counters[counter].load(std::memory_order_relaxed);
+            if (value == 0) continue;
+            out << std::left << std::setw(22) << counterName(counter) << std::right << value << "\n";
+        }
+        out.flush();
+    }
+    
+    void writeJson(std::ostream& out) const {
+        out << "{\n  \"counters\": {";
+        for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+            out << (counter ? "," : "") << "\n    \"" << counterName(counter) << "\": "
+                << counters[counter].load(std::memory_order_relaxed);
+        }
+        out << "\n  },\n  \"stages\": {";
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            const StageTotals& totals = stages[stage];
+            out << (stage ? "," : "") << "\n    \"" << stageName(stage) << "\": {\"calls\": "
+                << totals.calls.load(std::memory_order_relaxed) << ", \"wall_seconds\": " << seconds(totals.wallNanoseconds)
+                << ", \"cpu_seconds\": " << seconds(totals.cpuNanoseconds) << "}";
+        }
+        out << "\n  }\n}\n";
+    }
+    
+    // Prometheus text exposition format, e.g. for a node exporter textfile collector
+    void writePrometheus(std::ostream& out) const {
+        for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+            out << "# TYPE stock_analyzer_" << counterName(counter) << "_total counter\n"
+                << "stock_analyzer_" << counterName(counter) << "_total "
+                << counters[counter].load(std::memory_order_relaxed) << "\n";
+        }
+        const char* series[] = {"stage_calls_total", "stage_wall_seconds_total", "stage_cpu_seconds_total"};
+        for (int kind = 0; kind < 3; kind++) {
+            out << "# TYPE stock_analyzer_" << series[kind] << " counter\n";
+            for (int stage = 0; stage < STAGE_COUNT; stage++) {
+                const StageTotals& totals = stages[stage];
+                out << "stock_analyzer_" << series[kind] << "{stage=\"" << stageName(stage) << "\"} ";
+                if (kind == 0) out << totals.calls.load(std::memory_order_relaxed);
+                else if (kind == 1) out << seconds(totals.wallNanoseconds);
+                else out << seconds(totals.cpuNanoseconds);
+                out << "\n";
+            }
+        }
+    }
+    
+    // Write the metrics to a file as json or prometheus
+    bool write(const std::string& filename, const std::string& format) const {
+        std::ofstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file for writing: " << filename << std::endl;
+            return false;
         }
+        if (format == "prometheus") writePrometheus(file);
+        else writeJson(file);
+        return static_cast<bool>(file);
     }
+};
+
+Metrics& metrics() {
+    static Metrics instance;
+    return instance;
+}
 
-    // Reverse to get chronological order
-    std::reverse(prices.begin(), prices.end());
-    return prices;
+// CPU time used by the calling thread; by the whole process on Windows
+inline uint64_t threadCpuNanoseconds() {
+#ifdef _WIN32
+    return static_cast<uint64_t>(std::clock() * (1e9 / CLOCKS_PER_SEC));
+#else
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+#endif
 }
 
-// Stock class definition
-class Stock {
+// Adds the wall and process CPU time of its scope to a stage
+class ScopedTimer {
+private:
+    Metrics::Stage stage;
+    std::chrono::steady_clock::time_point wallStart;
+    std::clock_t cpuStart;
+    
 public:
-    std::string symbol;
-    double epsEstimate;
-    double actualEPS;
-    std::string earningsDate;
-    std::vector<double> prices;
-    std::vector<double> returns;
-    std::vector<double> abnormalReturns;
+    explicit ScopedTimer(Metrics::Stage timedStage)
+        : stage(timedStage), wallStart(std::chrono::steady_clock::now()), cpuStart(std::clock()) {}
+    
+    ~ScopedTimer() {
+        auto wall = std::chrono::steady_clock::now() - wallStart;
+        double cpuSeconds = static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+        metrics().record(stage, std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count(),
+                         static_cast<uint64_t>(std::max(0.0, cpuSeconds) * 1e9));
+    }
+    
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+// Receives a response body chunk by chunk while it downloads
+class ResponseSink {
+public:
+    virtual ~ResponseSink() {}
     
-    // Constructor
-    Stock(const std::string& sym, double eps, double actual, const std::string& date) 
-        : symbol(sym), epsEstimate(eps), actualEPS(actual), earningsDate(date) {}
+    // Returning false aborts the transfer
+    virtual bool write(const char* data, size_t size) = 0;
+};
+
+// Write callback function for libcurl
+size_t WriteCallback(char* contents, size_t size, size_t nmemb, void* userdata) {
+    size_t newLength = size * nmemb;
+    metrics().add(Metrics::BYTES_DOWNLOADED, newLength);
+    return static_cast<ResponseSink*>(userdata)->write(contents, newLength) ? newLength : 0;
+}
+
+// Pool of long-lived easy handles sharing DNS, TLS session and connection caches,
+// so repeated requests to the same host reuse a warm keep-alive connection
+class CurlHandlePool {
+private:
+    CURLSH* share;
+    std::vector<CURL*> idle;
+    std::mutex poolMutex;
+    std::mutex shareLocks[CURL_LOCK_DATA_LAST];
+    bool http2;
     
-    // Add a price
-    void addPrice(double price) {
-        prices.push_back(price);
+    static void lockShare(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+        static_cast<CurlHandlePool*>(userptr)->shareLocks[data].lock();
     }
     
-    // Calculate daily returns
-    void calculateReturns() {
-        returns.clear();
-        for (size_t i = 1; i < prices.size(); i++) {
-            double ret = (prices[i] - prices[i-1]) / prices[i-1];
-            returns.push_back(ret);
+    static void unlockShare(CURL*, curl_lock_data data, void* userptr) {
+        static_cast<CurlHandlePool*>(userptr)->shareLocks[data].unlock();
+    }
+    
+    void applyOptions(CURL* curl) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 60L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 30L);
+        curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L); // Give up on transfers stalled for a minute
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                         http2 ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1);
+    }
+    
+public:
+    CurlHandlePool() : share(curl_share_init()), http2(false) {
+        if (share) {
+            curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockShare);
+            curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+            curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
         }
     }
     
-    // Calculate abnormal returns against market (SPY)
-    void calculateAbnormalReturns(const std::vector<double>& marketReturns) {
-        abnormalReturns.clear();
-        for (size_t i = 0; i < returns.size() && i < marketReturns.size(); i++) {
-            abnormalReturns.push_back(returns[i] - marketReturns[i]);
+    ~CurlHandlePool() {
+        // Handles must go before the share they point at
+        for (CURL* curl : idle) curl_easy_cleanup(curl);
+        if (share) curl_share_cleanup(share);
+    }
+    
+    CurlHandlePool(const CurlHandlePool&) = delete;
+    CurlHandlePool& operator=(const CurlHandlePool&) = delete;
+    
+    // Negotiate HTTP/2 over TLS when the server supports it
+    void setHttp2(bool enabled) {
+        http2 = enabled;
+    }
+    
+    bool http2Enabled() const {
+        return http2;
+    }
+    
+    // Get a handle configured for keep-alive and the shared caches
+    CURL* acquire() {
+        CURL* curl = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            if (!idle.empty()) {
+                curl = idle.back();
+                idle.pop_back();
+            }
         }
+        if (!curl) curl = curl_easy_init();
+        if (curl) applyOptions(curl);
+        return curl;
+    }
+    
+    // Return a handle to the pool; its connection stays open for the next request
+    void release(CURL* curl) {
+        if (!curl) return;
+        curl_easy_reset(curl);
+        std::lock_guard<std::mutex> lock(poolMutex);
+        idle.push_back(curl);
+    }
+};
+
+// Token-bucket rate limiter sized to the API plan's request quota
+class RateLimiter {
+private:
+    double ratePerSecond;
+    double ceilingPerSecond; // Configured rate; throttling lowers ratePerSecond below it
+    double capacity;
+    double tokens;
+    std::chrono::steady_clock::time_point lastRefill;
+    std::chrono::steady_clock::time_point lastDecrease;
+    
+    static constexpr double MIN_REQUESTS_PER_MINUTE = 1.0;
+    static constexpr double UNLIMITED_THROTTLED_PER_MINUTE = 60.0; // Where an unlimited rate starts adapting
+    static constexpr double INCREASE_PER_MINUTE = 1.0;             // Regained per successful request
+    
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+        tokens = std::min(capacity, tokens + elapsed * ratePerSecond);
+        lastRefill = now;
+    }
+    
+public:
+    // A non-positive rate disables limiting
+    RateLimiter(double requestsPerMinute, double burst) {
+        setRate(requestsPerMinute, burst);
+    }
+    
+    void setRate(double requestsPerMinute, double burst) {
+        ratePerSecond = requestsPerMinute / 60.0;
+        ceilingPerSecond = ratePerSecond;
+        capacity = std::max(1.0, burst);
+        tokens = capacity;
+        lastRefill = std::chrono::steady_clock::now();
+        lastDecrease = lastRefill;
     }
     
-    // Get surprise percentage
-    double getSurprisePercentage() const {
-        if (epsEstimate != 0) {
-            return (actualEPS - epsEstimate) / std::abs(epsEstimate) * 100.0;
+    // Take a token if one is available
+    bool tryAcquire() {
+        if (ratePerSecond <= 0) return true;
+        refill();
+        if (tokens >= 1.0) {
+            tokens -= 1.0;
+            return true;
         }
-        return 0.0;
+        return false;
+    }
+    
+    // Milliseconds until the next token becomes available
+    long millisecondsUntilAvailable() {
+        if (ratePerSecond <= 0) return 0;
+        refill();
+        if (tokens >= 1.0) return 0;
+        return static_cast<long>(std::ceil((1.0 - tokens) / ratePerSecond * 1000.0));
+    }
+    
+    // The server throttled a request sent at requestStarted: halve the rate
+    // and empty the bucket (multiplicative decrease). Requests already in
+    // flight when the rate last dropped don't lower it again.
+    void slowDown(std::chrono::steady_clock::time_point requestStarted) {
+        if (requestStarted < lastDecrease) return;
+        refill();
+        double current = ratePerSecond > 0 ? ratePerSecond : UNLIMITED_THROTTLED_PER_MINUTE / 60.0;
+        ratePerSecond = std::max(MIN_REQUESTS_PER_MINUTE / 60.0, current * 0.5);
+        tokens = 0.0;
+        lastDecrease = std::chrono::steady_clock::now();
     }
     
-    // Determine group (Beat, Meet, Miss)
-    std::string getGroup() const {
-        double surprise = getSurprisePercentage();
-        if (surprise > 5.0) return "Beat";
-        else if (surprise < -5.0) return "Miss";
-        else return "Meet";
+    // A request went through: creep back towards the configured rate
+    // (additive increase)
+    void speedUp() {
+        if (ratePerSecond <= 0 || ratePerSecond == ceilingPerSecond) return;
+        refill();
+        ratePerSecond += INCREASE_PER_MINUTE / 60.0;
+        if (ceilingPerSecond > 0) ratePerSecond = std::min(ratePerSecond, ceilingPerSecond);
+    }
+    
+    // Current rate in requests per minute, 0 when unlimited
+    double requestsPerMinute() const {
+        return std::max(0.0, ratePerSecond * 60.0);
     }
 };
 
-// Group class to store collections of stocks
-class Group {
+// Wait for activity on a set of sockets, through WSAPoll on Windows
+#ifdef _WIN32
+typedef WSAPOLLFD SocketPoll;
+inline int pollSockets(SocketPoll* sockets, size_t count, int timeoutMs) {
+    if (count == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+        return 0;
+    }
+    return WSAPoll(sockets, static_cast<ULONG>(count), timeoutMs);
+}
+#else
+typedef pollfd SocketPoll;
+inline int pollSockets(SocketPoll* sockets, size_t count, int timeoutMs) {
+    return poll(sockets, static_cast<nfds_t>(count), timeoutMs);
+}
+#endif
+
+// Concurrent fetch engine built on curl_multi. It drives curl through
+// curl_multi_socket_action: curl says which sockets to watch and when it
+// next needs a timeout, and each wakeup only services the sockets that
+// have activity, so thousands of transfers can be in flight on one thread.
+// The engine is long-lived: requests are submitted at any time, even while
+// others are in flight, and join the same multi handle, connections and
+// rate limit. One thread drives it by calling step(); wake() interrupts
+// that thread's wait from any other.
+class FetchEngine {
 public:
-    std::string name;
-    std::vector<Stock*> stocks;
-    std::vector<double> aar; // Average Abnormal Return
-    std::vector<double> caar; // Cumulative Average Abnormal Return
+    // What the caller made of a finished transfer
+    enum Outcome {
+        DONE,      // Finished, successfully or for good
+        RETRY,     // Transient failure: try again after a backoff
+        THROTTLED  // The server is rate limiting: slow down, then try again
+    };
+    
+    typedef std::function<ResponseSink*(size_t)> SinkFactory;
+    typedef std::function<Outcome(size_t, CURLcode, long, bool)> CompletionHandler;
+    typedef std::function<void(std::exception_ptr)> FinishHandler;
+    
+    static constexpr int DEFAULT_MAX_ATTEMPTS = 5;
+    
+private:
+    struct Job;
+    
+    // One submit() call: its callbacks and how many of its URLs are unfinished
+    struct Request {
+        SinkFactory sinkFor;
+        CompletionHandler onComplete;
+        FinishHandler onFinished;
+        size_t remaining;
+        bool failed;                // A callback threw; the request's other transfers are dropped
+        std::deque<Job*> unstarted; // In submission order
+    };
+    
+    // One URL, from its first attempt to its last
+    struct Job {
+        std::shared_ptr<Request> request;
+        std::string url;
+        size_t index; // Within the request
+        int attempts;
+        std::chrono::steady_clock::time_point started;
+        std::list<Job>::iterator self;
+    };
     
-    Group(const std::string& groupName) : name(groupName) {}
+    struct PendingRetry {
+        Job* job;
+        std::chrono::steady_clock::time_point due;
+        
+        bool operator>(const PendingRetry& other) const {
+            return due > other.due;
+        }
+    };
+    
+    CurlHandlePool& pool;
+    CURLM* multi;
+    int maxInFlight;
+    int maxAttempts;
+    RateLimiter limiter;
+    std::minstd_rand jitter;
+    std::map<curl_socket_t, int> watched; // Sockets curl wants watched, and for what (CURL_POLL_*)
+    bool timerSet;                        // Whether curl wants a timeout call at timerDue
+    std::chrono::steady_clock::time_point timerDue;
+    std::list<Job> jobs;                  // Every unfinished URL
+    std::deque<Request*> starting;        // Requests with unstarted URLs, taking turns
+    std::priority_queue<PendingRetry, std::vector<PendingRetry>, std::greater<PendingRetry>> retries;
+    int active;
+    bool throttled; // Waiting on the rate limiter since throttledSince
+    std::chrono::steady_clock::time_point throttledSince;
+    int wakeRead;   // Self-pipe that wake() writes to, polled with the sockets; -1 without one
+    int wakeWrite;
+    
+    static constexpr long BASE_BACKOFF_MS = 1000;
+    static constexpr long MAX_BACKOFF_MS = 32000;
     
-    void addStock(Stock* stock) {
-        stocks.push_back(stock);
+    // Wait before the next attempt: doubles with each attempt up to a cap, and
+    // is drawn from the upper half of that so failed requests don't all come
+    // back at once
+    std::chrono::milliseconds backoff(int attempts) {
+        long delay = std::min(MAX_BACKOFF_MS, BASE_BACKOFF_MS << std::min(attempts - 1, 5));
+        return std::chrono::milliseconds(std::uniform_int_distribution<long>(delay / 2, delay)(jitter));
     }
     
-    // Calculate AAR for the group
-    void calculateAAR() {
-        if (stocks.empty()) return;
+    // curl's word on which sockets to watch
+    static int socketCallback(CURL*, curl_socket_t socket, int what, void* engine, void*) {
+        std::map<curl_socket_t, int>& watched = static_cast<FetchEngine*>(engine)->watched;
+        if (what == CURL_POLL_REMOVE) watched.erase(socket);
+        else watched[socket] = what;
+        return 0;
+    }
+    
+    // curl's word on when it next needs a timeout call; -1 for never
+    static int timerCallback(CURLM*, long timeoutMs, void* userp) {
+        FetchEngine* engine = static_cast<FetchEngine*>(userp);
+        engine->timerSet = timeoutMs >= 0;
+        engine->timerDue = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(0L, timeoutMs));
+        return 0;
+    }
+    
+    // Wait up to timeoutMs for the watched sockets or a wake(), then let
+    // curl act on the sockets that are ready, and on its timeout if that is due
+    void waitAndAct(long timeoutMs) {
+        auto now = std::chrono::steady_clock::now();
+        if (timerSet) {
+            long untilTimer = std::chrono::duration_cast<std::chrono::milliseconds>(timerDue - now).count();
+            timeoutMs = std::min(timeoutMs, std::max(0L, untilTimer));
+        }
+        std::vector<SocketPoll> sockets;
+        sockets.reserve(watched.size() + 1);
+        for (const auto& socket : watched) {
+            SocketPoll entry = {};
+            entry.fd = socket.first;
+            if (socket.second == CURL_POLL_IN || socket.second == CURL_POLL_INOUT) entry.events |= POLLIN;
+            if (socket.second == CURL_POLL_OUT || socket.second == CURL_POLL_INOUT) entry.events |= POLLOUT;
+            sockets.push_back(entry);
+        }
+        size_t socketCount = sockets.size();
+#ifndef _WIN32
+        if (wakeRead >= 0) {
+            SocketPoll entry = {};
+            entry.fd = wakeRead;
+            entry.events = POLLIN;
+            sockets.push_back(entry);
+        }
+#endif
+        int ready = pollSockets(sockets.data(), sockets.size(), static_cast<int>(timeoutMs));
         
-        // Initialize AAR vector with zeros
-        int daysCount = stocks[0]->abnormalReturns.size();
-        aar.resize(daysCount, 0.0);
+#ifndef _WIN32
+        if (ready > 0 && sockets.size() > socketCount && sockets.back().revents) {
+            char drained[64];
+            while (read(wakeRead, drained, sizeof(drained)) > 0) {}
+        }
+#endif
+        int running = 0;
+        for (size_t i = 0; ready > 0 && i < socketCount; i++) {
+            if (!sockets[i].revents) continue;
+            int mask = 0;
+            if (sockets[i].revents & POLLIN) mask |= CURL_CSELECT_IN;
+            if (sockets[i].revents & POLLOUT) mask |= CURL_CSELECT_OUT;
+            if (sockets[i].revents & (POLLERR | POLLHUP | POLLNVAL)) mask |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(multi, sockets[i].fd, mask, &running);
+        }
+        if (timerSet && std::chrono::steady_clock::now() >= timerDue) {
+            timerSet = false;
+            curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+    }
+    
+    // Mark a request failed and hand it the exception; its remaining
+    // transfers are dropped as they come up
+    void fail(Request& request, std::exception_ptr error) {
+        if (request.failed) return;
+        request.failed = true;
+        request.onFinished(error);
+    }
+    
+    void drop(Job& job) {
+        jobs.erase(job.self);
+    }
+    
+    // The next URL to start, from the request whose turn it is
+    Job* nextUnstarted() {
+        while (!starting.empty()) {
+            Request& request = *starting.front();
+            if (!request.failed) return request.unstarted.front();
+            std::shared_ptr<Request> keep = request.unstarted.front()->request;
+            starting.pop_front();
+            for (Job* job : request.unstarted) drop(*job);
+            request.unstarted.clear();
+        }
+        return nullptr;
+    }
+    
+    void markStarted() {
+        Request* request = starting.front();
+        starting.pop_front();
+        request->unstarted.pop_front();
+        if (!request->unstarted.empty()) starting.push_back(request);
+    }
+    
+    // Hand a finished attempt to its request, then retire the URL or
+    // schedule its retry
+    void finishAttempt(Job& job, CURLcode result, long status) {
+        Request& request = *job.request;
+        if (request.failed) {
+            drop(job);
+            return;
+        }
+        bool lastAttempt = job.attempts >= maxAttempts;
+        Outcome outcome;
+        try {
+            outcome = request.onComplete(job.index, result, status, lastAttempt);
+        } catch (...) {
+            std::shared_ptr<Request> keep = job.request;
+            drop(job);
+            fail(*keep, std::current_exception());
+            return;
+        }
+        if (outcome == THROTTLED) {
+            metrics().add(Metrics::THROTTLED_RESPONSES);
+            limiter.slowDown(job.started);
+        } else if (outcome == DONE && result == CURLE_OK) {
+            limiter.speedUp();
+        }
         
-        // Sum abnormal returns for each day
-        for (Stock* stock : stocks) {
-            for (size_t day = 0; day < daysCount && day < stock->abnormalReturns.size(); day++) {
-                aar[day] += stock->abnormalReturns[day];
+        if (outcome == DONE || lastAttempt) {
+            std::shared_ptr<Request> keep = job.request;
+            drop(job);
+            if (--keep->remaining == 0) keep->onFinished(nullptr);
+        } else {
+            metrics().add(Metrics::RETRIES);
+            retries.push(PendingRetry{&job, std::chrono::steady_clock::now() + backoff(job.attempts)});
+        }
+    }
+    
+public:
+    FetchEngine(CurlHandlePool& handles, int maxConcurrent, double requestsPerMinute, double burst)
+        : pool(handles), multi(curl_multi_init()), maxInFlight(std::max(1, maxConcurrent)),
+          maxAttempts(DEFAULT_MAX_ATTEMPTS), limiter(requestsPerMinute, burst), jitter(std::random_device{}()),
+          timerSet(false), active(0), throttled(false), wakeRead(-1), wakeWrite(-1) {
+        if (multi) {
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+            curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socketCallback);
+            curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timerCallback);
+            curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+        }
+#ifndef _WIN32
+        int ends[2];
+        if (pipe(ends) == 0) {
+            for (int end : ends) {
+                fcntl(end, F_SETFL, fcntl(end, F_GETFL) | O_NONBLOCK);
+                fcntl(end, F_SETFD, FD_CLOEXEC);
             }
+            wakeRead = ends[0];
+            wakeWrite = ends[1];
         }
-        
-        // Calculate average
-        for (size_t day = 0; day < daysCount; day++) {
-            aar[day] /= stocks.size();
+#endif
+    }
+    
+    ~FetchEngine() {
+        if (multi) curl_multi_cleanup(multi);
+#ifndef _WIN32
+        if (wakeRead >= 0) ::close(wakeRead);
+        if (wakeWrite >= 0) ::close(wakeWrite);
+#endif
+    }
+    
+    FetchEngine(const FetchEngine&) = delete;
+    FetchEngine& operator=(const FetchEngine&) = delete;
+    
+    void setMaxConcurrent(int maxConcurrent) {
+        maxInFlight = std::max(1, maxConcurrent);
+    }
+    
+    // Attempts per URL, the first included
+    void setMaxAttempts(int attempts) {
+        maxAttempts = std::max(1, attempts);
+    }
+    
+    void setRateLimit(double requestsPerMinute, double burst) {
+        limiter.setRate(requestsPerMinute, burst);
+    }
+    
+    // Queue URLs for transfer and return; step() does the work. sinkFor is
+    // called as each attempt starts and receives its body while it downloads;
+    // onComplete is called as each attempt finishes, in completion order,
+    // with the curl result, the HTTP status and whether it was the last
+    // attempt allowed. Its outcome decides whether the URL is tried again.
+    // onFinished is called once: after the last URL's final attempt, or as
+    // soon as one of the request's callbacks throws, with that exception, in
+    // which case the request's other transfers are dropped. It must not throw.
+    // Requests take turns starting their URLs, so a small one submitted
+    // behind a large one isn't kept waiting for all of it to start.
+    // Retries wait out a jittered exponential backoff, then go ahead of new
+    // URLs within the same concurrency cap and rate limit; a throttled
+    // response also halves the rate, which then climbs back by one request
+    // per minute for each success.
+    void submit(const std::vector<std::string>& urls, const SinkFactory& sinkFor, const CompletionHandler& onComplete,
+                const FinishHandler& onFinished) {
+        if (urls.empty()) {
+            onFinished(nullptr);
+            return;
+        }
+        if (!multi) std::cerr << "CURL error: failed to create multi handle" << std::endl;
+        std::shared_ptr<Request> request(new Request{sinkFor, onComplete, onFinished, urls.size(), false, std::deque<Job*>()});
+        for (size_t i = 0; i < urls.size(); i++) {
+            jobs.push_back(Job{request, urls[i], i, 0, std::chrono::steady_clock::time_point(), std::list<Job>::iterator()});
+            jobs.back().self = std::prev(jobs.end());
+            request->unstarted.push_back(&jobs.back());
         }
+        starting.push_back(request.get());
     }
     
-    // Calculate CAAR for the group
-    void calculateCAAR() {
-        caar.clear();
-        double cumulative = 0.0;
-        
-        for (double dailyAAR : aar) {
-            cumulative += dailyAAR;
-            caar.push_back(cumulative);
+    // Whether any submitted URL is unfinished
+    bool busy() const {
+        return !jobs.empty();
+    }
+    
+    // Interrupt step()'s wait, from any thread
+    void wake() {
+#ifndef _WIN32
+        if (wakeWrite >= 0) {
+            char signal = 1;
+            if (write(wakeWrite, &signal, 1) < 0) {} // A full pipe already wakes the loop
         }
+#endif
     }
     
-    // Sample stocks for bootstrapping
-    std::vector<Stock*> sampleStocks(int sampleSize) {
-        std::vector<Stock*> sample;
-        if (stocks.size() <= sampleSize) {
-            return stocks; // Return all if we don't have enough
+    // Start what the concurrency cap and rate limit allow, hand finished
+    // transfers to their requests, then wait up to maxWaitMs for socket
+    // activity, the limiter, the next retry or a wake(). Without a self-pipe
+    // (Windows), a wake() is only noticed when the wait ends.
+    void step(long maxWaitMs) {
+        // Start due retries, then new transfers, while under the concurrency cap and quota
+        auto now = std::chrono::steady_clock::now();
+        while (active < maxInFlight) {
+            bool retryDue = !retries.empty() && retries.top().due <= now;
+            Job* job = retryDue ? retries.top().job : nextUnstarted();
+            if (!job) break;
+            if (job->request->failed) {
+                retries.pop();
+                drop(*job);
+                continue;
+            }
+            if (!limiter.tryAcquire()) {
+                if (!throttled) throttledSince = now;
+                throttled = true;
+                break;
+            }
+            if (throttled) {
+                auto waited = std::chrono::steady_clock::now() - throttledSince;
+                metrics().record(Metrics::RATE_LIMIT_WAIT, std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count(), 0);
+                throttled = false;
+            }
+            if (retryDue) retries.pop();
+            else markStarted();
+            job->attempts++;
+            job->started = std::chrono::steady_clock::now();
+            
+            CURL* easy = multi ? pool.acquire() : nullptr;
+            if (!easy) {
+                std::cerr << "CURL error: failed to create handle for " << job->url << std::endl;
+                job->attempts = std::max(job->attempts, maxAttempts);
+                finishAttempt(*job, CURLE_FAILED_INIT, 0);
+                continue;
+            }
+            ResponseSink* sink = nullptr;
+            try {
+                sink = job->request->sinkFor(job->index);
+            } catch (...) {
+                pool.release(easy);
+                std::shared_ptr<Request> keep = job->request;
+                drop(*job);
+                fail(*keep, std::current_exception());
+                continue;
+            }
+            curl_easy_setopt(easy, CURLOPT_URL, job->url.c_str());
+            curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, WriteCallback);
+            curl_easy_setopt(easy, CURLOPT_WRITEDATA, sink);
+            curl_easy_setopt(easy, CURLOPT_PRIVATE, job);
+            curl_multi_add_handle(multi, easy);
+            metrics().add(Metrics::REQUESTS);
+            active++;
         }
         
-        // Create a copy to shuffle
-        std::vector<Stock*> stocksCopy = stocks;
-        
-        // Use a random device for true randomness
-        std::random_device rd;
-        std::mt19937 g(rd());
+        // Hand finished transfers to their requests, and schedule the ones they want retried
+        int queued = 0;
+        while (CURLMsg* msg = multi ? curl_multi_info_read(multi, &queued) : nullptr) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            
+            CURL* easy = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            Job* job = nullptr;
+            long status = 0;
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, &job);
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+            if (result != CURLE_OK) {
+                std::cerr << "CURL error: " << curl_easy_strerror(result) << std::endl;
+                metrics().add(Metrics::TRANSFER_ERRORS);
+            }
+            curl_multi_remove_handle(multi, easy);
+            pool.release(easy);
+            active--;
+            finishAttempt(*job, result, status);
+        }
         
-        // Shuffle and take the first sampleSize elements
-        std::shuffle(stocksCopy.begin(), stocksCopy.end(), g);
-        sample.assign(stocksCopy.begin(), stocksCopy.begin() + sampleSize);
+        if (!busy()) return;
         
-        return sample;
+        // Wait for socket activity, until the limiter allows the next
+        // request, or until the next retry is due
+        long timeoutMs = maxWaitMs;
+        if (active < maxInFlight) {
+            auto now = std::chrono::steady_clock::now();
+            long untilRetry = timeoutMs;
+            if (!retries.empty()) {
+                untilRetry = std::max<long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                    retries.top().due - now).count());
+            }
+            if (!starting.empty() || untilRetry == 0) {
+                timeoutMs = std::min(timeoutMs, limiter.millisecondsUntilAvailable());
+            } else {
+                timeoutMs = std::min(timeoutMs, untilRetry);
+            }
+        }
+        waitAndAct(timeoutMs);
     }
 };
 
-// MarketData class to handle market data
-class MarketData {
-private:
-    std::string apiKey;
+// Location and cause of a malformed CSV field
+struct ParseError {
+    size_t row;    // 1-based line number, header included
+    size_t column; // 1-based field number
+    std::string message;
+};
+
+// Summary of a CSV parse: rows accepted and the first few malformed fields
+struct ParseReport {
+    static constexpr size_t MAX_KEPT_ERRORS = 5;
     
-public:
-    MarketData(const std::string& key) : apiKey(key) {}
+    size_t rowsParsed = 0;
+    size_t errorCount = 0;
+    std::vector<ParseError> errors;
     
-    // Fetch historical data for a symbol and date range
-    std::vector<double> fetchHistoricalData(const std::string& symbol, const std::string& startDate, const std::string& endDate) {
-        std::string url = "https://www.alphavantage.co/query?function=TIME_SERIES_DAILY_ADJUSTED"
-                         "&symbol=" + symbol + 
-                         "&apikey=" + apiKey + 
-                         "&datatype=csv";
-        
-        std::string data = fetchData(url);
-        return parsePrices(data);
+    void addError(size_t row, size_t column, const char* message) {
+        if (errors.size() < MAX_KEPT_ERRORS) errors.push_back(ParseError{row, column, message});
+        errorCount++;
     }
     
-    // Calculate market returns (SPY)
-    std::vector<double> calculateMarketReturns(const std::vector<double>& marketPrices) {
-        std::vector<double> returns;
-        for (size_t i = 1; i < marketPrices.size(); i++) {
-            double ret = (marketPrices[i] - marketPrices[i-1]) / marketPrices[i-1];
-            returns.push_back(ret);
+    // Count the parse in the metrics, and print one summary for the whole
+    // input instead of a line per bad row
+    void print(const std::string& source) const {
+        metrics().add(Metrics::ROWS_PARSED, rowsParsed);
+        metrics().add(Metrics::PARSE_ERRORS, errorCount);
+        if (errorCount == 0) return;
+        std::cerr << source << ": " << errorCount << " malformed field(s), " << rowsParsed << " rows parsed" << std::endl;
+        for (const ParseError& error : errors) {
+            std::cerr << "  row " << error.row << ", column " << error.column << ": " << error.message << std::endl;
         }
-        return returns;
     }
 };
 
-// StockAnalyzer class to handle the analysis process
-class StockAnalyzer {
+// Take the next line off a buffer, without its line ending
+inline bool nextLine(std::string_view& buffer, std::string_view& line) {
+    if (buffer.empty()) return false;
+    size_t end = buffer.find('\n');
+    if (end == std::string_view::npos) {
+        line = buffer;
+        buffer = std::string_view();
+    } else {
+        line = buffer.substr(0, end);
+        buffer.remove_prefix(end + 1);
+    }
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    return true;
+}
+
+// Take the next comma-separated field off a line
+inline std::string_view nextField(std::string_view& line) {
+    size_t end = line.find(',');
+    std::string_view field = line.substr(0, end);
+    line.remove_prefix(end == std::string_view::npos ? line.size() : end + 1);
+    return field;
+}
+
+inline std::string_view trimField(std::string_view field) {
+    while (!field.empty() && (field.front() == ' ' || field.front() == '\t')) field.remove_prefix(1);
+    while (!field.empty() && (field.back() == ' ' || field.back() == '\t')) field.remove_suffix(1);
+    return field;
+}
+
+inline bool parseNumber(std::string_view field, double& value) {
+    field = trimField(field);
+    if (!field.empty() && field.front() == '+') field.remove_prefix(1);
+    const char* end = field.data() + field.size();
+    std::from_chars_result result = std::from_chars(field.data(), end, value);
+    return !field.empty() && result.ec == std::errc() && result.ptr == end && std::isfinite(value);
+}
+
+// Find a named column in a CSV header
+inline int findColumn(std::string_view header, std::string_view name, int fallback) {
+    for (int column = 0; !header.empty(); column++) {
+        if (trimField(nextField(header)) == name) return column;
+    }
+    return fallback;
+}
+
+// Incremental parser for the daily-adjusted CSV, fed from the curl write
+// callback. Complete rows go straight into the series while the download is
+// in progress; only a partial line left at the end of a chunk is buffered.
+// Reads only the date and adjusted close columns and keeps only the bars
+// inside the requested date range.
+class PriceStreamParser : public ResponseSink {
 private:
-    MarketData marketData;
-    std::map<std::string, Stock> stocksMap;
-    Group beatGroup;
-    Group meetGroup;
-    Group missGroup;
-    std::vector<double> marketPrices;
-    std::vector<double> marketReturns;
+    static constexpr size_t MAX_UNEXPECTED_BYTES = 512;
     
-public:
-    StockAnalyzer(const std::string& apiKey) 
-        : marketData(apiKey), beatGroup("Beat"), meetGroup("Meet"), missGroup("Miss") {}
+    enum State { AWAITING_HEADER, IN_ROWS, NOT_CSV };
     
-    // Load stock data from a file
-    void loadStockDataFromFile(const std::string& filename) {
-        std::ifstream file(filename);
-        if (!file.is_open()) {
-            std::cerr << "Failed to open file: " << filename << std::endl;
+    State state;
+    DateRange keep;
+    PriceSeries series;
+    ParseReport report;
+    std::string carry;
+    std::string unexpected;
+    size_t row;
+    int closeColumn;
+    
+    void parseLine(std::string_view line) {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        
+        // Locate the adjusted close column from the header
+        if (state == AWAITING_HEADER) {
+            if (trimField(line).empty()) return;
+            closeColumn = findColumn(line, "adjusted_close", 5);
+            state = IN_ROWS;
+            row = 1;
+            return;
+        }
+        
+        row++;
+        if (line.empty()) return;
+        
+        int day;
+        if (!parseDate(trimField(nextField(line)), day)) {
+            report.addError(row, 1, "invalid date");
+            return;
+        }
+        if (!keep.contains(day)) return;
+        
+        int column = 1;
+        std::string_view field;
+        while (column <= closeColumn && !line.empty()) {
+            field = nextField(line);
+            column++;
+        }
+        
+        double price;
+        if (column <= closeColumn || !parseNumber(field, price)) {
+            report.addError(row, closeColumn + 1, "invalid adjusted close");
             return;
         }
+        series.dates.push_back(day);
+        series.prices.push_back(price);
+        report.rowsParsed++;
+    }
+    
+public:
+    explicit PriceStreamParser(const DateRange& range = DateRange::all())
+        : state(AWAITING_HEADER), keep(range), row(0), closeColumn(5) {}
+    
+    bool write(const char* data, size_t size) override {
+        std::string_view chunk(data, size);
+        
+        // Error and throttling messages come back as JSON rather than CSV
+        if (state == AWAITING_HEADER && carry.empty()) {
+            size_t first = chunk.find_first_not_of(" \t\r\n");
+            if (first != std::string_view::npos && chunk[first] == '{') state = NOT_CSV;
+        }
+        if (state == NOT_CSV) {
+            unexpected.append(chunk.substr(0, MAX_UNEXPECTED_BYTES - std::min(MAX_UNEXPECTED_BYTES, unexpected.size())));
+            return true;
+        }
+        
+        // Complete the line left over from the previous chunk
+        if (!carry.empty()) {
+            size_t end = chunk.find('\n');
+            if (end == std::string_view::npos) {
+                carry.append(chunk);
+                return true;
+            }
+            carry.append(chunk.substr(0, end));
+            parseLine(carry);
+            carry.clear();
+            chunk.remove_prefix(end + 1);
+        }
+        
+        size_t end;
+        while ((end = chunk.find('\n')) != std::string_view::npos) {
+            parseLine(chunk.substr(0, end));
+            chunk.remove_prefix(end + 1);
+        }
+        carry.append(chunk);
+        return true;
+    }
+    
+    // Parse any final unterminated line and put the bars in chronological
+    // order; the API sends the newest first, local files may not
+    void finish() {
+        if (state != NOT_CSV && !carry.empty()) parseLine(carry);
+        carry.clear();
+        if (series.dates.size() > 1 && series.dates.front() > series.dates.back()) {
+            std::reverse(series.dates.begin(), series.dates.end());
+            std::reverse(series.prices.begin(), series.prices.end());
+        }
+    }
+    
+    const ParseReport& parseReport() const {
+        return report;
+    }
+    
+    // Whether a CSV header arrived, so an empty series means no bars in range
+    bool receivedCsv() const {
+        return state == IN_ROWS;
+    }
+    
+    // The start of the body if it wasn't CSV, e.g. an API error message
+    const std::string& unexpectedResponse() const {
+        return unexpected;
+    }
+    
+    PriceSeries takeSeries() {
+        return std::move(series);
+    }
+};
+
+// Parse CSV data to extract dated adjusted closes
+PriceSeries parsePrices(std::string_view data, ParseReport* report = nullptr) {
+    PriceStreamParser parser;
+    parser.write(data.data(), data.size());
+    parser.finish();
+    if (report) *report = parser.parseReport();
+    return parser.takeSeries();
+}
+
+// Read-only memory map of a whole file
+class MappedFile {
+private:
+    const char* base;
+    size_t length;
+#ifdef _WIN32
+    std::vector<char> buffer; // No mmap here, read the file instead
+#endif
+    
+public:
+    MappedFile() : base(nullptr), length(0) {}
+    ~MappedFile() { close(); }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    bool open(const std::string& path) {
+        close();
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return false;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        base = buffer.data();
+        length = buffer.size();
+        return true;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        base = static_cast<const char*>(mapped);
+        length = static_cast<size_t>(info.st_size);
+        return true;
+#endif
+    }
+    
+    void close() {
+#ifdef _WIN32
+        std::vector<char>().swap(buffer);
+#else
+        if (base) munmap(const_cast<char*>(base), length);
+#endif
+        base = nullptr;
+        length = 0;
+    }
+    
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+};
+
+// Zero-copy view of one symbol's bars inside the mapped price store
+struct PriceView {
+    const int32_t* dates;
+    const double* prices;
+    size_t count;
+};
+
+// On-disk price cache in a binary columnar store (prices.bin) that is
+// memory-mapped rather than parsed. Layout:
+//   header     magic, version, symbol count, bar count, section offsets
+//   directory  one entry per symbol, sorted: symbol, first bar, bar count and
+//              the date range the bars were fetched for
+//   dates      int32 days since 1970-01-01 for every bar, grouped by symbol
+//   prices     double adjusted closes in the same order as the dates
+// Each symbol's bars are one contiguous, chronological run in both columns.
+// New series are appended to a journal (prices.log) as they arrive, so a crash
+// loses nothing, and are folded into the columnar file by flush(). A
+// read-only cache only maps prices.bin: it ignores the journal and never
+// writes to the directory.
+struct CachedSeries {
+    PriceSeries series;
+    DateRange coverage; // Days the series is known to be complete for
+};
+
+class PriceCache {
+private:
+    static constexpr char MAGIC[9] = "SAPRICES";
+    static constexpr uint32_t VERSION = 2;
+    static constexpr size_t SYMBOL_SIZE = 16;
+    
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t symbolCount;
+        uint64_t barCount;
+        uint64_t directoryOffset;
+        uint64_t datesOffset;
+        uint64_t pricesOffset;
+        uint64_t reserved[2];
+    };
+    
+    struct DirectoryEntry {
+        char symbol[SYMBOL_SIZE];
+        uint64_t firstBar;
+        uint32_t barCount;
+        int32_t coveredFrom;
+        int32_t coveredTo;
+        int32_t reserved;
+    };
+    
+    struct JournalRecord {
+        char symbol[SYMBOL_SIZE];
+        int32_t coveredFrom;
+        int32_t coveredTo;
+        uint32_t barCount;
+    };
+    
+    struct JournalRef {
+        uint64_t offset; // Start of the record's dates
+        uint32_t barCount;
+        DateRange coverage;
+    };
+    
+    std::string directory;
+    MappedFile storeFile;
+    const DirectoryEntry* entries;
+    uint32_t symbolCount;
+    const int32_t* dates;
+    const double* prices;
+    std::map<std::string, JournalRef> pending;
+    std::ofstream journal;
+    uint64_t journalSize;
+    bool readOnly;
+    
+    std::string storePath() const { return directory + "/prices.bin"; }
+    std::string journalPath() const { return directory + "/prices.log"; }
+    std::string tmpPath() const { return directory + "/prices.bin.tmp"; }
+    
+    static std::string entrySymbol(const char* symbol) {
+        return std::string(symbol, strnlen(symbol, SYMBOL_SIZE));
+    }
+    
+    const DirectoryEntry* findEntry(const std::string& symbol) const {
+        const DirectoryEntry* end = entries + symbolCount;
+        const DirectoryEntry* it = std::lower_bound(entries, end, symbol,
+            [](const DirectoryEntry& entry, const std::string& key) {
+                return entrySymbol(entry.symbol) < key;
+            });
+        if (it != end && entrySymbol(it->symbol) == symbol) return it;
+        return nullptr;
+    }
+    
+    // Whether count items of a size starting at offset lie inside the file;
+    // the count is compared against the bytes left, so nothing can wrap
+    static bool fits(const MappedFile& file, uint64_t offset, uint64_t count, size_t size) {
+        return offset <= file.size() && count <= (file.size() - offset) / size;
+    }
+    
+    // Read a mapped store's header and check that the file holds every column.
+    // The columns are written in order after the header, so a file cut short
+    // anywhere fails the check.
+    static bool readHeader(const MappedFile& file, Header& header) {
+        if (file.size() < sizeof(header)) return false;
+        std::memcpy(&header, file.data(), sizeof(header));
+        return std::memcmp(header.magic, MAGIC, 8) == 0 && header.version == VERSION &&
+               fits(file, header.directoryOffset, header.symbolCount, sizeof(DirectoryEntry)) &&
+               fits(file, header.datesOffset, header.barCount, sizeof(int32_t)) &&
+               fits(file, header.pricesOffset, header.barCount, sizeof(double));
+    }
+    
+    // Check that every entry's bars lie inside the columns and that the
+    // symbols are sorted, as findEntry searches them by halves
+    static bool entriesValid(const DirectoryEntry* list, uint32_t count, uint64_t barCount) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (list[i].firstBar > barCount || barCount - list[i].firstBar < list[i].barCount) return false;
+            if (i > 0 && !(entrySymbol(list[i - 1].symbol) < entrySymbol(list[i].symbol))) return false;
+        }
+        return true;
+    }
+    
+    // Map prices.bin and check its header and directory
+    void openStore() {
+        entries = nullptr;
+        symbolCount = 0;
+        dates = nullptr;
+        prices = nullptr;
+        if (!storeFile.open(storePath())) return;
+        
+        Header header;
+        bool valid = readHeader(storeFile, header) &&
+                     entriesValid(reinterpret_cast<const DirectoryEntry*>(storeFile.data() + header.directoryOffset),
+                                  header.symbolCount, header.barCount);
+        if (!valid) {
+            std::cerr << "Ignoring invalid price store: " << storePath() << std::endl;
+            storeFile.close();
+            return;
+        }
+        entries = reinterpret_cast<const DirectoryEntry*>(storeFile.data() + header.directoryOffset);
+        symbolCount = header.symbolCount;
+        dates = reinterpret_cast<const int32_t*>(storeFile.data() + header.datesOffset);
+        prices = reinterpret_cast<const double*>(storeFile.data() + header.pricesOffset);
+    }
+    
+    // Index the journal left by an interrupted run; a torn final record is dropped
+    void recoverJournal() {
+        MappedFile log;
+        if (!log.open(journalPath())) return;
+        uint64_t offset = 0;
+        while (offset + sizeof(JournalRecord) <= log.size()) {
+            JournalRecord record;
+            std::memcpy(&record, log.data() + offset, sizeof(record));
+            uint64_t body = static_cast<uint64_t>(record.barCount) * (sizeof(int32_t) + sizeof(double));
+            if (offset + sizeof(record) + body > log.size()) break;
+            JournalRef ref = { offset + sizeof(record), record.barCount, DateRange{record.coveredFrom, record.coveredTo} };
+            pending[entrySymbol(record.symbol)] = ref;
+            offset += sizeof(record) + body;
+        }
+        journalSize = offset;
+    }
+    
+    // Deal with prices.bin.tmp left by a flush that died before its rename.
+    // Where the old store is removed ahead of the rename (Windows), a
+    // complete temporary file with no store beside it is the new store;
+    // anything else is a partial write and is dropped. The journal is only
+    // removed after a rename, so its records are replayed either way.
+    void recoverStore() {
+        struct stat info;
+        if (stat(tmpPath().c_str(), &info) != 0) return;
+        bool complete = false;
+        if (stat(storePath().c_str(), &info) != 0) {
+            MappedFile tmp;
+            Header header;
+            complete = tmp.open(tmpPath()) && readHeader(tmp, header);
+        }
+        if (!complete || std::rename(tmpPath().c_str(), storePath().c_str()) != 0) {
+            std::remove(tmpPath().c_str());
+        }
+    }
+    
+    void open() {
+        pending.clear();
+        journalSize = 0;
+        if (enabled() && !readOnly) recoverStore();
+        openStore();
+        if (!enabled() || readOnly) return;
+        recoverJournal();
+        if (!pending.empty()) flush();
+    }
+    
+    bool ensureDirectory() const {
+#ifdef _WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0755);
+#endif
+        struct stat info;
+        return stat(directory.c_str(), &info) == 0;
+    }
+    
+public:
+    explicit PriceCache(const std::string& dir, bool readOnlyStore = false)
+        : directory(dir), entries(nullptr), symbolCount(0), dates(nullptr), prices(nullptr), journalSize(0),
+          readOnly(readOnlyStore) {
+        open();
+    }
+    
+    ~PriceCache() {
+        flush();
+    }
+    
+    PriceCache(const PriceCache&) = delete;
+    PriceCache& operator=(const PriceCache&) = delete;
+    
+    // An empty directory disables the cache
+    void setDirectory(const std::string& dir) {
+        flush();
+        storeFile.close();
+        directory = dir;
+        open();
+    }
+    
+    bool enabled() const {
+        return !directory.empty();
+    }
+    
+    // View a symbol's bars in the mapped store without copying; bars stored
+    // since the last flush are only visible through load()
+    bool view(const std::string& symbol, PriceView& result, DateRange& coverage) const {
+        const DirectoryEntry* entry = findEntry(symbol);
+        if (!entry) return false;
+        result.dates = dates + entry->firstBar;
+        result.prices = prices + entry->firstBar;
+        result.count = entry->barCount;
+        coverage = DateRange{entry->coveredFrom, entry->coveredTo};
+        return true;
+    }
+    
+    // Load a cached series and the dates it covers
+    bool load(const std::string& symbol, CachedSeries& entry) {
+        if (!enabled()) return false;
+        PriceSeries& series = entry.series;
+        
+        auto it = pending.find(symbol);
+        if (it != pending.end()) {
+            journal.flush();
+            std::ifstream log(journalPath(), std::ios::binary);
+            const JournalRef& ref = it->second;
+            series.dates.resize(ref.barCount);
+            series.prices.resize(ref.barCount);
+            log.seekg(static_cast<std::streamoff>(ref.offset));
+            log.read(reinterpret_cast<char*>(series.dates.data()), ref.barCount * sizeof(int32_t));
+            log.read(reinterpret_cast<char*>(series.prices.data()), ref.barCount * sizeof(double));
+            entry.coverage = ref.coverage;
+            return log.good();
+        }
+        
+        PriceView stored;
+        if (!view(symbol, stored, entry.coverage)) return false;
+        series.dates.assign(stored.dates, stored.dates + stored.count);
+        series.prices.assign(stored.prices, stored.prices + stored.count);
+        return true;
+    }
+    
+    // Store a series, replacing any previous entry for the symbol
+    bool store(const std::string& symbol, const CachedSeries& entry) {
+        const PriceSeries& series = entry.series;
+        if (!enabled() || readOnly) return false;
+        if (symbol.size() > SYMBOL_SIZE) {
+            std::cerr << "Symbol too long to cache: " << symbol << std::endl;
+            return false;
+        }
+        if (!journal.is_open()) {
+            if (!ensureDirectory()) {
+                std::cerr << "Failed to create cache directory: " << directory << std::endl;
+                return false;
+            }
+            journal.open(journalPath(), std::ios::binary | std::ios::app);
+            if (!journal.is_open()) {
+                std::cerr << "Failed to open cache journal: " << journalPath() << std::endl;
+                return false;
+            }
+        }
+        
+        JournalRecord record;
+        std::memset(&record, 0, sizeof(record));
+        std::memcpy(record.symbol, symbol.data(), symbol.size());
+        record.coveredFrom = entry.coverage.first;
+        record.coveredTo = entry.coverage.last;
+        record.barCount = static_cast<uint32_t>(series.prices.size());
+        
+        journal.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        journal.write(reinterpret_cast<const char*>(series.dates.data()), series.dates.size() * sizeof(int32_t));
+        journal.write(reinterpret_cast<const char*>(series.prices.data()), series.prices.size() * sizeof(double));
+        journal.flush();
+        
+        JournalRef ref = { journalSize + sizeof(record), record.barCount, entry.coverage };
+        pending[symbol] = ref;
+        journalSize += sizeof(record) + record.barCount * (sizeof(int32_t) + sizeof(double));
+        return journal.good();
+    }
+    
+    // Fold journaled series into a new columnar file and remap it
+    bool flush() {
+        if (!enabled() || readOnly || pending.empty()) return true;
+        journal.close();
+        
+        MappedFile log;
+        if (!log.open(journalPath())) return false;
+        
+        // Merge the mapped directory with the journal, both sorted by symbol
+        struct Source {
+            std::string symbol;
+            const char* dates;
+            const char* prices;
+            uint32_t barCount;
+            DateRange coverage;
+        };
+        std::vector<Source> sources;
+        auto next = pending.begin();
+        for (uint32_t i = 0; i <= symbolCount; i++) {
+            std::string symbol = i < symbolCount ? entrySymbol(entries[i].symbol) : std::string();
+            while (next != pending.end() && (i == symbolCount || next->first <= symbol)) {
+                const JournalRef& ref = next->second;
+                Source source = { next->first, log.data() + ref.offset,
+                                  log.data() + ref.offset + ref.barCount * sizeof(int32_t),
+                                  ref.barCount, ref.coverage };
+                sources.push_back(source);
+                ++next;
+            }
+            if (i < symbolCount && (sources.empty() || sources.back().symbol != symbol)) {
+                const DirectoryEntry& entry = entries[i];
+                Source source = { symbol, reinterpret_cast<const char*>(dates + entry.firstBar),
+                                  reinterpret_cast<const char*>(prices + entry.firstBar),
+                                  entry.barCount, DateRange{entry.coveredFrom, entry.coveredTo} };
+                sources.push_back(source);
+            }
+        }
+        
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, MAGIC, 8);
+        header.version = VERSION;
+        header.symbolCount = static_cast<uint32_t>(sources.size());
+        for (const Source& source : sources) header.barCount += source.barCount;
+        header.directoryOffset = sizeof(Header);
+        header.datesOffset = header.directoryOffset + sources.size() * sizeof(DirectoryEntry);
+        header.pricesOffset = (header.datesOffset + header.barCount * sizeof(int32_t) + 7) & ~uint64_t(7);
+        
+        {
+            std::ofstream out(tmpPath(), std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                std::cerr << "Failed to open price store for writing: " << tmpPath() << std::endl;
+                return false;
+            }
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            
+            uint64_t firstBar = 0;
+            for (const Source& source : sources) {
+                DirectoryEntry entry;
+                std::memset(&entry, 0, sizeof(entry));
+                std::memcpy(entry.symbol, source.symbol.data(), source.symbol.size());
+                entry.firstBar = firstBar;
+                entry.barCount = source.barCount;
+                entry.coveredFrom = source.coverage.first;
+                entry.coveredTo = source.coverage.last;
+                out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+                firstBar += source.barCount;
+            }
+            for (const Source& source : sources) {
+                out.write(source.dates, source.barCount * sizeof(int32_t));
+            }
+            static const char padding[8] = {};
+            out.write(padding, header.pricesOffset - (header.datesOffset + header.barCount * sizeof(int32_t)));
+            for (const Source& source : sources) {
+                out.write(source.prices, source.barCount * sizeof(double));
+            }
+            if (!out.good()) {
+                std::cerr << "Failed to write price store: " << tmpPath() << std::endl;
+                return false;
+            }
+        }
+        
+        log.close();
+        storeFile.close();
+#ifdef _WIN32
+        // rename() won't replace an existing file here; recoverStore() finishes
+        // the job if the process dies in between
+        std::remove(storePath().c_str());
+#endif
+        // On POSIX the rename replaces the old store atomically
+        bool renamed = std::rename(tmpPath().c_str(), storePath().c_str()) == 0;
+        if (renamed) {
+            std::remove(journalPath().c_str());
+            pending.clear();
+            journalSize = 0;
+        }
+        openStore();
+        return renamed;
+    }
+};
+
+// Scalar kernels, also used for the tails of the vector loops
+void simpleReturnsScalar(const double* prices, size_t count, double* out) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = (prices[i + 1] - prices[i]) / prices[i];
+    }
+}
+
+void subtractScalar(const double* a, const double* b, size_t count, double* out) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = a[i] - b[i];
+    }
+}
+
+void accumulateScalar(double* sum, const double* row, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        sum[i] += row[i];
+    }
+}
+
+#ifdef STOCK_ANALYZER_X86_KERNELS
+__attribute__((target("avx2")))
+void simpleReturnsAvx2(const double* prices, size_t count, double* out) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d prev = _mm256_loadu_pd(prices + i);
+        __m256d next = _mm256_loadu_pd(prices + i + 1);
+        _mm256_storeu_pd(out + i, _mm256_div_pd(_mm256_sub_pd(next, prev), prev));
+    }
+    simpleReturnsScalar(prices + i, count - i, out + i);
+}
+
+__attribute__((target("avx2")))
+void subtractAvx2(const double* a, const double* b, size_t count, double* out) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    subtractScalar(a + i, b + i, count - i, out + i);
+}
+
+__attribute__((target("avx2")))
+void accumulateAvx2(double* sum, const double* row, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(sum + i, _mm256_add_pd(_mm256_loadu_pd(sum + i), _mm256_loadu_pd(row + i)));
+    }
+    accumulateScalar(sum + i, row + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+void simpleReturnsAvx512(const double* prices, size_t count, double* out) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512d prev = _mm512_loadu_pd(prices + i);
+        __m512d next = _mm512_loadu_pd(prices + i + 1);
+        _mm512_storeu_pd(out + i, _mm512_div_pd(_mm512_sub_pd(next, prev), prev));
+    }
+    simpleReturnsScalar(prices + i, count - i, out + i);
+}
+
+__attribute__((target("avx512f")))
+void subtractAvx512(const double* a, const double* b, size_t count, double* out) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm512_storeu_pd(out + i, _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)));
+    }
+    subtractScalar(a + i, b + i, count - i, out + i);
+}
+
+__attribute__((target("avx512f")))
+void accumulateAvx512(double* sum, const double* row, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm512_storeu_pd(sum + i, _mm512_add_pd(_mm512_loadu_pd(sum + i), _mm512_loadu_pd(row + i)));
+    }
+    accumulateScalar(sum + i, row + i, count - i);
+}
+#endif
+
+#ifdef STOCK_ANALYZER_NEON_KERNELS
+void simpleReturnsNeon(const double* prices, size_t count, double* out) {
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        float64x2_t prev = vld1q_f64(prices + i);
+        float64x2_t next = vld1q_f64(prices + i + 1);
+        vst1q_f64(out + i, vdivq_f64(vsubq_f64(next, prev), prev));
+    }
+    simpleReturnsScalar(prices + i, count - i, out + i);
+}
+
+void subtractNeon(const double* a, const double* b, size_t count, double* out) {
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        vst1q_f64(out + i, vsubq_f64(vld1q_f64(a + i), vld1q_f64(b + i)));
+    }
+    subtractScalar(a + i, b + i, count - i, out + i);
+}
+
+void accumulateNeon(double* sum, const double* row, size_t count) {
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        vst1q_f64(sum + i, vaddq_f64(vld1q_f64(sum + i), vld1q_f64(row + i)));
+    }
+    accumulateScalar(sum + i, row + i, count - i);
+}
+#endif
+
+// Kernels for the return and group math, picked once for the widest
+// instruction set the CPU supports. Outputs are written into presized
+// buffers. Only plain adds, subtracts and divides are used, so every variant
+// gives bit-identical results.
+struct Kernels {
+    const char* name;
+    // out[i] = (prices[i + 1] - prices[i]) / prices[i] for i < count
+    void (*simpleReturns)(const double* prices, size_t count, double* out);
+    // out[i] = a[i] - b[i]
+    void (*subtract)(const double* a, const double* b, size_t count, double* out);
+    // sum[i] += row[i]
+    void (*accumulate)(double* sum, const double* row, size_t count);
+};
+
+// STOCK_ANALYZER_KERNELS=scalar|avx2|avx512|neon caps the choice, for comparisons
+Kernels selectKernels() {
+    const char* requested = std::getenv("STOCK_ANALYZER_KERNELS");
+    std::string cap = requested ? requested : "";
+    
+#ifdef STOCK_ANALYZER_X86_KERNELS
+    __builtin_cpu_init();
+    if ((cap.empty() || cap == "avx512") && __builtin_cpu_supports("avx512f")) {
+        return Kernels{"avx512", simpleReturnsAvx512, subtractAvx512, accumulateAvx512};
+    }
+    if ((cap.empty() || cap == "avx512" || cap == "avx2") && __builtin_cpu_supports("avx2")) {
+        return Kernels{"avx2", simpleReturnsAvx2, subtractAvx2, accumulateAvx2};
+    }
+#endif
+#ifdef STOCK_ANALYZER_NEON_KERNELS
+    if (cap.empty() || cap == "neon") {
+        return Kernels{"neon", simpleReturnsNeon, subtractNeon, accumulateNeon};
+    }
+#endif
+    return Kernels{"scalar", simpleReturnsScalar, subtractScalar, accumulateScalar};
+}
+
+const Kernels& kernels() {
+    static const Kernels selected = selectKernels();
+    return selected;
+}
+
+// Trading calendar taken from the market series. A dense table maps every
+// calendar day in its span to a trading-day index, so stocks line up with the
+// market by date in O(1) instead of by searching.
+class TradingCalendar {
+private:
+    int firstDay;
+    std::vector<int> tradingDates;   // Trading-day index -> date
+    std::vector<int> onOrAfter;      // Day - firstDay -> index of the first trading day on or after it
+    
+public:
+    TradingCalendar() : firstDay(0) {}
+    
+    // Build from the market's bar dates, in chronological order
+    void build(const std::vector<int>& dates) {
+        tradingDates = dates;
+        onOrAfter.clear();
+        if (dates.empty()) return;
+        
+        firstDay = dates.front();
+        onOrAfter.resize(dates.back() - firstDay + 1);
+        size_t index = 0;
+        for (size_t offset = 0; offset < onOrAfter.size(); offset++) {
+            if (firstDay + static_cast<int>(offset) > tradingDates[index]) index++;
+            onOrAfter[offset] = static_cast<int>(index);
+        }
+    }
+    
+    size_t size() const {
+        return tradingDates.size();
+    }
+    
+    int dateAt(size_t index) const {
+        return tradingDates[index];
+    }
+    
+    const std::vector<int>& dates() const {
+        return tradingDates;
+    }
+    
+    // Index of the first trading day on or after day, or -1 past the end
+    int indexOnOrAfter(int day) const {
+        if (tradingDates.empty() || day > tradingDates.back()) return -1;
+        if (day < firstDay) return 0;
+        return onOrAfter[day - firstDay];
+    }
+    
+    // Index of day if it is a trading day, otherwise -1
+    int indexOf(int day) const {
+        int index = indexOnOrAfter(day);
+        return index >= 0 && tradingDates[index] == day ? index : -1;
+    }
+};
+
+// Read-only view of a run of values owned elsewhere
+struct SeriesView {
+    const double* first;
+    size_t count;
+    
+    SeriesView() : first(nullptr), count(0) {}
+    SeriesView(const double* values, size_t offset, size_t length) : first(values + offset), count(length) {}
+    
+    const double* data() const { return first; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const double* begin() const { return first; }
+    const double* end() const { return first + count; }
+    double operator[](size_t i) const { return first[i]; }
+};
+
+// A column of doubles that is either owned, or borrowed in place from a
+// mapped snapshot, which it keeps mapped. Reads go through data() and
+// size(); anything that changes the column calls own() first, which copies
+// a borrowed column into the vector on first use.
+class MappedColumn {
+private:
+    std::vector<double> values;
+    std::shared_ptr<const MappedFile> mapping;
+    const double* borrowed;
+    size_t borrowedSize;
+    
+public:
+    MappedColumn() : borrowed(nullptr), borrowedSize(0) {}
+    
+    const double* data() const { return borrowed ? borrowed : values.data(); }
+    size_t size() const { return borrowed ? borrowedSize : values.size(); }
+    bool isBorrowed() const { return borrowed != nullptr; }
+    
+    std::vector<double>& own() {
+        if (borrowed) {
+            values.assign(borrowed, borrowed + borrowedSize);
+            release();
+        }
+        return values;
+    }
+    
+    // Point at count doubles inside a mapping
+    void borrow(std::shared_ptr<const MappedFile> file, const double* first, size_t count) {
+        std::vector<double>().swap(values);
+        mapping = std::move(file);
+        borrowed = first;
+        borrowedSize = count;
+    }
+    
+    // Take over a new vector as the contents
+    void replace(std::vector<double>& next) {
+        release();
+        values.swap(next);
+    }
+    
+    // Drop the contents and their memory
+    void clear() {
+        std::vector<double>().swap(values);
+        release();
+    }
+    
+private:
+    void release() {
+        mapping.reset();
+        borrowed = nullptr;
+        borrowedSize = 0;
+    }
+};
+
+// One symbol's prices aligned to the trading calendar over a run of days,
+// with their returns and abnormal returns. Once computed it is copied into
+// the event store's price arena, and every event of the symbol whose window
+// falls in the run views it there, so events with overlapping windows share
+// one copy of the bars and compute their returns once.
+struct PriceSegment {
+    int calendarStart; // Trading-calendar index of prices[0]
+    std::vector<double> prices;
+    std::vector<double> returns;
+    std::vector<double> abnormalReturns;
+    
+    PriceSegment() : calendarStart(-1) {}
+    
+    // Take length trading days of prices from calendar index start. Days the
+    // stock didn't trade carry the previous close; days before its first
+    // known close stay NaN. Returns false if no close is known at all.
+    bool fill(const PriceSeries& series, const TradingCalendar& calendar, int start, int length) {
+        calendarStart = -1;
+        prices.assign(length, std::numeric_limits<double>::quiet_NaN());
+        
+        double before = std::numeric_limits<double>::quiet_NaN(); // Last close ahead of the run
+        for (size_t i = 0; i < series.dates.size(); i++) {
+            int t = calendar.indexOf(series.dates[i]);
+            if (t >= start && t < start + length) {
+                prices[t - start] = series.prices[i];
+            } else if (series.dates[i] < calendar.dateAt(start)) {
+                before = series.prices[i];
+            }
+        }
+        
+        for (int k = 0; k < length; k++) {
+            if (std::isnan(prices[k])) prices[k] = k > 0 ? prices[k - 1] : before;
+        }
+        if (prices.empty() || std::isnan(prices.back())) {
+            prices.clear();
+            return false;
+        }
+        calendarStart = start;
+        return true;
+    }
+    
+    // Calculate daily returns
+    void calculateReturns() {
+        returns.resize(prices.empty() ? 0 : prices.size() - 1);
+        kernels().simpleReturns(prices.data(), returns.size(), returns.data());
+    }
+    
+    // Calculate abnormal returns against market (SPY). marketReturns[t] is
+    // the market's return from calendar day t to t + 1, so it lines up with
+    // the segment at calendarStart.
+    void calculateAbnormalReturns(const std::vector<double>& marketReturns) {
+        size_t available = calendarStart >= 0 && static_cast<size_t>(calendarStart) < marketReturns.size()
+                           ? marketReturns.size() - calendarStart : 0;
+        abnormalReturns.resize(std::min(returns.size(), available));
+        kernels().subtract(returns.data(), marketReturns.data() + (available ? calendarStart : 0),
+                           abnormalReturns.size(), abnormalReturns.data());
+    }
+    
+    // Calculate abnormal returns against the market model: the stock's
+    // return less alpha plus beta times the market's
+    void calculateAbnormalReturns(const std::vector<double>& marketReturns, double alpha, double beta) {
+        calculateAbnormalReturns(marketReturns);
+        const double* market = marketReturns.data() + (abnormalReturns.empty() ? 0 : calendarStart);
+        for (size_t i = 0; i < abnormalReturns.size(); i++) {
+            abnormalReturns[i] = returns[i] - (alpha + beta * market[i]);
+        }
+    }
+};
+
+// How abnormal returns are measured: against the market's return, or
+// against a market model fitted over an estimation window before each event
+enum ReturnModel {
+    MARKET_ADJUSTED,
+    MARKET_MODEL
+};
+
+// OLS fits of a segment's returns on the market's. One pass over the
+// segment builds prefix sums of the count, Σm, Σm², Σr and Σmr over the days
+// where both returns are known; any span's alpha and beta then cost O(1).
+// Every event in a segment is fitted from the same pass, so there is no
+// regression per event, and missing days simply drop out of the sums.
+class EstimationSums {
+private:
+    struct Totals {
+        double count;
+        double market;
+        double marketSquared;
+        double stock;
+        double cross;
+    };
+    std::vector<Totals> prefix; // prefix[j] sums segment returns 0 to j - 1
+    
+public:
+    void build(const PriceSegment& segment, const std::vector<double>& marketReturns) {
+        prefix.resize(segment.returns.size() + 1);
+        Totals running = {0.0, 0.0, 0.0, 0.0, 0.0};
+        prefix[0] = running;
+        for (size_t j = 0; j < segment.returns.size(); j++) {
+            size_t t = segment.calendarStart + j;
+            double r = segment.returns[j];
+            double m = t < marketReturns.size() ? marketReturns[t] : std::numeric_limits<double>::quiet_NaN();
+            if (std::isfinite(r) && std::isfinite(m)) {
+                running.count += 1.0;
+                running.market += m;
+                running.marketSquared += m * m;
+                running.stock += r;
+                running.cross += m * r;
+            }
+            prefix[j + 1] = running;
+        }
+    }
+    
+    // Fit r = alpha + beta * m over segment returns first to last - 1.
+    // False if fewer than minimum days are known or the market didn't move.
+    bool fit(size_t first, size_t last, size_t minimum, double& alpha, double& beta) const {
+        if (first >= last || last >= prefix.size()) return false;
+        const Totals& from = prefix[first];
+        const Totals& to = prefix[last];
+        double n = to.count - from.count;
+        if (n < std::max<size_t>(minimum, 2)) return false;
+        double market = to.market - from.market;
+        double stock = to.stock - from.stock;
+        double squares = to.marketSquared - from.marketSquared;
+        double variance = squares - market * market / n;
+        if (!(variance > 1e-12 * squares)) return false; // Flat, up to rounding
+        beta = ((to.cross - from.cross) - market * stock / n) / variance;
+        alpha = (stock - beta * market) / n;
+        return true;
+    }
+};
+
+// Snapshot arrays: a uint64 element count, then the elements, zero-padded
+// to 8 bytes so that every array stays aligned in the mapped file and the
+// large double columns can be used in place
+template <typename T>
+void writeSnapshotArray(std::ostream& out, const T* values, uint64_t count) {
+    static const char zeros[8] = {};
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(values), count * sizeof(T));
+    out.write(zeros, (8 - count * sizeof(T) % 8) % 8);
+}
+
+template <typename T>
+void writeSnapshotArray(std::ostream& out, const std::vector<T>& values) {
+    writeSnapshotArray(out, values.data(), values.size());
+}
+
+inline void writeSnapshotString(std::ostream& out, const std::string& text) {
+    writeSnapshotArray(out, text.data(), text.size());
+}
+
+// Reads snapshot arrays back out of a mapped file, copying small arrays and
+// lending large double columns in place. Every read is checked against the
+// end of the file, and the first failure sticks.
+class SnapshotReader {
+private:
+    std::shared_ptr<const MappedFile> file;
+    const char* data;
+    size_t size;
+    size_t offset;
+    bool valid;
+    
+    bool skipPadding(size_t bytes) {
+        size_t padding = (8 - bytes % 8) % 8;
+        if (padding > size - offset) return valid = false;
+        offset += padding;
+        return true;
+    }
+    
+    bool take(void* out, size_t bytes) {
+        if (!valid || bytes > size - offset) return valid = false;
+        if (bytes > 0) std::memcpy(out, data + offset, bytes);
+        offset += bytes;
+        return true;
+    }
+    
+public:
+    explicit SnapshotReader(std::shared_ptr<const MappedFile> mapped)
+        : file(std::move(mapped)), data(file->data()), size(file->size()), offset(0), valid(true) {}
+    
+    bool ok() const {
+        return valid;
+    }
+    
+    // A fixed-size record, such as the header
+    template <typename T>
+    bool read(T& value) {
+        return take(&value, sizeof(T));
+    }
+    
+    template <typename T>
+    bool array(std::vector<T>& values) {
+        uint64_t count;
+        if (!take(&count, sizeof(count)) || count > (size - offset) / sizeof(T)) return valid = false;
+        values.resize(count);
+        if (!take(values.data(), count * sizeof(T))) return false;
+        return skipPadding(count * sizeof(T));
+    }
+    
+    // A double array, borrowed from the mapping when it is aligned there
+    // (always, for a mapped file) and copied otherwise
+    bool column(MappedColumn& values) {
+        uint64_t count;
+        if (!take(&count, sizeof(count)) || count > (size - offset) / sizeof(double)) return valid = false;
+        const char* first = data + offset;
+        if (reinterpret_cast<uintptr_t>(first) % alignof(double) != 0) {
+            std::vector<double>& owned = values.own();
+            owned.resize(count);
+            take(owned.data(), count * sizeof(double));
+        } else {
+            values.borrow(file, reinterpret_cast<const double*>(first), count);
+            offset += count * sizeof(double);
+        }
+        return skipPadding(count * sizeof(double));
+    }
+    
+    bool string(std::string& text) {
+        std::vector<char> chars;
+        if (!array(chars)) return false;
+        text.assign(chars.begin(), chars.end());
+        return true;
+    }
+};
+
+// Handle of an earnings event: its row in the EventStore's columns
+typedef uint32_t EventHandle;
+
+// Where a segment landed in the event store's price arena
+struct SegmentRef {
+    size_t offset;        // Arena index of the segment's first price
+    int calendarStart;    // Trading-calendar index of that price
+    size_t length;        // Prices in the segment
+    size_t abnormalCount; // Abnormal returns available from offset
+};
+
+// Earnings events stored column by column: each field is one contiguous
+// buffer indexed by EventHandle, and symbols are interned once. Price
+// segments are appended end to end to three arena buffers (prices, returns
+// and abnormal returns at the same offsets, returns padded to the price
+// length), and each event records the offset of its window. Loading N
+// events grows a few buffers instead of allocating per event, and clearing
+// frees them in one go. Removed events are only marked dead, keeping their
+// handles; clearWindows() gives back the arena.
+class EventStore {
+public:
+    static constexpr int32_t NO_GROUP = -1;
+    static constexpr int64_t NO_WINDOW = -1;
+    
+    // Symbol table
+    std::vector<std::string> symbolNames;
+    std::map<std::string, uint32_t, std::less<>> symbolIds;
+    
+    // Event columns
+    std::vector<uint32_t> symbols;
+    std::vector<double> epsEstimates;
+    std::vector<double> actualEPS;
+    std::vector<int> earningsDays; // Days since 1970-01-01
+    std::vector<double> surprises; // Percent
+    std::vector<char> live;
+    std::vector<int32_t> groupIds;  // Group holding the event, or NO_GROUP
+    std::vector<uint32_t> groupRows; // Row of the event in its group's event matrix
+    std::vector<int64_t> windowOffsets; // Arena index of the window's first price, or NO_WINDOW
+    std::vector<uint32_t> abnormalCounts;
+    
+    // Price arena; borrowed from the file after a snapshot restore, until it changes
+    MappedColumn arenaPrices;
+    MappedColumn arenaReturns;
+    MappedColumn arenaAbnormalReturns;
+    
+    int window;       // Trading days either side of the earnings date in every view
+    int lookback;     // Trading days before the earnings date to fetch, when more than the window
+    size_t liveCount;
+    
+private:
+    std::vector<EventHandle> order; // Live events by symbol, then date
+    bool orderValid;
+    
+    void ensureOrder() {
+        if (orderValid) return;
+        order.clear();
+        for (EventHandle h = 0; h < live.size(); h++) {
+            if (live[h]) order.push_back(h);
+        }
+        std::sort(order.begin(), order.end(), [this](EventHandle a, EventHandle b) {
+            if (symbols[a] != symbols[b]) return symbolNames[symbols[a]] < symbolNames[symbols[b]];
+            if (earningsDays[a] != earningsDays[b]) return earningsDays[a] < earningsDays[b];
+            return a < b;
+        });
+        orderValid = true;
+    }
+    
+public:
+    explicit EventStore(int tradingDays) : window(tradingDays), lookback(0), liveCount(0), orderValid(true) {}
+    
+    size_t size() const {
+        return live.size();
+    }
+    
+    // Add an event; 0 surprise when the estimate is 0
+    EventHandle add(std::string_view symbol, double epsEstimate, double actual, int earningsDay) {
+        auto found = symbolIds.find(symbol);
+        if (found == symbolIds.end()) {
+            found = symbolIds.emplace(std::string(symbol), static_cast<uint32_t>(symbolNames.size())).first;
+            symbolNames.push_back(found->first);
+        }
+        EventHandle h = static_cast<EventHandle>(live.size());
+        symbols.push_back(found->second);
+        epsEstimates.push_back(epsEstimate);
+        actualEPS.push_back(actual);
+        earningsDays.push_back(earningsDay);
+        surprises.push_back(epsEstimate != 0 ? (actual - epsEstimate) / std::abs(epsEstimate) * 100.0 : 0.0);
+        live.push_back(1);
+        groupIds.push_back(NO_GROUP);
+        groupRows.push_back(0);
+        windowOffsets.push_back(NO_WINDOW);
+        abnormalCounts.push_back(0);
+        liveCount++;
+        orderValid = false;
+        return h;
+    }
+    
+    // Mark an event dead; it must not be in a group
+    void remove(EventHandle h) {
+        if (!live[h]) return;
+        live[h] = 0;
+        liveCount--;
+        orderValid = false;
+    }
+    
+    // Drop events added from first onwards that repeat the symbol and date
+    // of an earlier event. Returns the dropped handles.
+    std::vector<EventHandle> removeDuplicates(EventHandle first) {
+        ensureOrder();
+        std::vector<EventHandle> dropped;
+        for (size_t k = 1; k < order.size(); k++) {
+            EventHandle previous = order[k - 1], h = order[k];
+            if (h >= first && symbols[h] == symbols[previous] && earningsDays[h] == earningsDays[previous]) {
+                dropped.push_back(h);
+            }
+        }
+        for (EventHandle h : dropped) remove(h);
+        return dropped;
+    }
+    
+    // Live events by symbol, then date
+    const std::vector<EventHandle>& ordered() {
+        ensureOrder();
+        return order;
+    }
+    
+    // A symbol's live events, earliest first
+    std::vector<EventHandle> eventsOf(std::string_view symbol) {
+        std::vector<EventHandle> events;
+        auto found = symbolIds.find(symbol);
+        if (found == symbolIds.end()) return events;
+        ensureOrder();
+        auto first = std::lower_bound(order.begin(), order.end(), found->first, [this](EventHandle h, const std::string& name) {
+            return symbolNames[symbols[h]] < name;
+        });
+        for (; first != order.end() && symbols[*first] == found->second; ++first) events.push_back(*first);
+        return events;
+    }
+    
+    const std::string& symbol(EventHandle h) const {
+        return symbolNames[symbols[h]];
+    }
+    
+    // Calendar days to fetch so that the given number of trading days is
+    // covered, with slack for holidays: about ten weekdays a year, so the
+    // slack grows with the span
+    static int calendarDaysFor(int tradingDays) {
+        return tradingDays * 7 / 5 + tradingDays / 20 + 10;
+    }
+    
+    // Dates to fetch for an event's window and lookback
+    DateRange eventRange(EventHandle h) const {
+        return DateRange{earningsDays[h] - calendarDaysFor(std::max(window, lookback) + 1),
+                         earningsDays[h] + calendarDaysFor(window)};
+    }
+    
+    // Calendar index of the bar before an event's window, which runs window
+    // trading days either side of the earnings date, or -1 if the calendar
+    // doesn't cover the window
+    int windowStart(EventHandle h, const TradingCalendar& calendar) const {
+        int event = calendar.indexOnOrAfter(earningsDays[h]);
+        if (event < window + 1 || event + window >= static_cast<int>(calendar.size())) return -1;
+        return event - window - 1;
+    }
+    
+    // Calendar index of the bar before an event's lookback, or of the
+    // calendar's first bar if the lookback reaches past it; -1 if the
+    // calendar doesn't cover the window
+    int lookbackStart(EventHandle h, const TradingCalendar& calendar) const {
+        int start = windowStart(h, calendar);
+        if (start < 0) return -1;
+        return std::max(0, start + window - std::max(window, lookback));
+    }
+    
+    // Fetch and align lookback trading days before each earnings date, e.g.
+    // for an estimation window; the views still cover only the window
+    void setLookback(int tradingDays) {
+        lookback = std::max(0, tradingDays);
+    }
+    
+    // Copy a computed segment to the end of the arena
+    SegmentRef appendSegment(const PriceSegment& segment) {
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+        SegmentRef ref{arenaPrices.size(), segment.calendarStart, segment.prices.size(), segment.abnormalReturns.size()};
+        std::vector<double>& prices = arenaPrices.own();
+        std::vector<double>& returns = arenaReturns.own();
+        std::vector<double>& abnormalReturns = arenaAbnormalReturns.own();
+        prices.insert(prices.end(), segment.prices.begin(), segment.prices.end());
+        returns.insert(returns.end(), segment.returns.begin(), segment.returns.end());
+        returns.resize(prices.size(), nan);
+        abnormalReturns.insert(abnormalReturns.end(), segment.abnormalReturns.begin(), segment.abnormalReturns.end());
+        abnormalReturns.resize(prices.size(), nan);
+        return ref;
+    }
+    
+    // Point an event at its window inside an arena segment, given the
+    // window's calendar start. Returns false if the segment doesn't hold the
+    // whole window, or has no close at its start.
+    bool attach(EventHandle h, const SegmentRef& ref, int start) {
+        detach(h);
+        int offset = start - ref.calendarStart;
+        size_t length = 2 * window + 2;
+        if (start < 0 || ref.calendarStart < 0 || offset < 0 || offset + length > ref.length ||
+            std::isnan(arenaPrices.data()[ref.offset + offset])) {
+            return false;
+        }
+        windowOffsets[h] = static_cast<int64_t>(ref.offset + offset);
+        abnormalCounts[h] = static_cast<uint32_t>(ref.abnormalCount > static_cast<size_t>(offset)
+                                                  ? std::min(length - 1, ref.abnormalCount - offset) : 0);
+        return true;
+    }
+    
+    // Drop an event's prices and returns
+    void detach(EventHandle h) {
+        windowOffsets[h] = NO_WINDOW;
+        abnormalCounts[h] = 0;
+    }
+    
+    // Event window: window trading days either side plus the bar before
+    SeriesView prices(EventHandle h) const {
+        if (windowOffsets[h] == NO_WINDOW) return SeriesView();
+        return SeriesView(arenaPrices.data(), windowOffsets[h], 2 * window + 2);
+    }
+    
+    // Returns from day -window to +window
+    SeriesView returns(EventHandle h) const {
+        if (windowOffsets[h] == NO_WINDOW) return SeriesView();
+        return SeriesView(arenaReturns.data(), windowOffsets[h], 2 * window + 1);
+    }
+    
+    SeriesView abnormalReturns(EventHandle h) const {
+        if (windowOffsets[h] == NO_WINDOW) return SeriesView();
+        return SeriesView(arenaAbnormalReturns.data(), windowOffsets[h], abnormalCounts[h]);
+    }
+    
+    // Drop every event's window and empty the arena, e.g. for a new window length
+    void clearWindows(int tradingDays) {
+        window = tradingDays;
+        std::fill(windowOffsets.begin(), windowOffsets.end(), NO_WINDOW);
+        std::fill(abnormalCounts.begin(), abnormalCounts.end(), 0);
+        arenaPrices.clear();
+        arenaReturns.clear();
+        arenaAbnormalReturns.clear();
+    }
+    
+    // Reserve arena room for the given number of prices, so appends don't reallocate
+    void reserveArena(size_t prices) {
+        arenaPrices.own().reserve(arenaPrices.size() + prices);
+        arenaReturns.own().reserve(arenaReturns.size() + prices);
+        arenaAbnormalReturns.own().reserve(arenaAbnormalReturns.size() + prices);
+    }
+    
+    // Write the symbol table, the event columns and the arena to a snapshot
+    void writeSnapshot(std::ostream& out) const {
+        int32_t settings[2] = {window, lookback};
+        writeSnapshotArray(out, settings, 2);
+        writeSnapshotArray(out, std::vector<uint64_t>(1, symbolNames.size()));
+        for (const std::string& name : symbolNames) writeSnapshotString(out, name);
+        writeSnapshotArray(out, symbols);
+        writeSnapshotArray(out, epsEstimates);
+        writeSnapshotArray(out, actualEPS);
+        writeSnapshotArray(out, earningsDays);
+        writeSnapshotArray(out, surprises);
+        writeSnapshotArray(out, live);
+        writeSnapshotArray(out, groupIds);
+        writeSnapshotArray(out, groupRows);
+        writeSnapshotArray(out, windowOffsets);
+        writeSnapshotArray(out, abnormalCounts);
+        writeSnapshotArray(out, arenaPrices.data(), arenaPrices.size());
+        writeSnapshotArray(out, arenaReturns.data(), arenaReturns.size());
+        writeSnapshotArray(out, arenaAbnormalReturns.data(), arenaAbnormalReturns.size());
+    }
+    
+    // Read what writeSnapshot wrote, leaving the arena in the mapped file.
+    // False if the file is short or its columns and windows don't fit together.
+    bool readSnapshot(SnapshotReader& in) {
+        std::vector<int32_t> settings;
+        std::vector<uint64_t> nameCount;
+        if (!in.array(settings) || settings.size() != 2 || settings[0] < 1 || !in.array(nameCount) || nameCount.size() != 1) {
+            return false;
+        }
+        window = settings[0];
+        lookback = settings[1];
+        symbolNames.clear();
+        symbolIds.clear();
+        for (uint64_t i = 0; i < nameCount[0] && in.ok(); i++) {
+            std::string name;
+            if (in.string(name)) {
+                symbolIds.emplace(name, static_cast<uint32_t>(symbolNames.size()));
+                symbolNames.push_back(name);
+            }
+        }
+        in.array(symbols);
+        in.array(epsEstimates);
+        in.array(actualEPS);
+        in.array(earningsDays);
+        in.array(surprises);
+        in.array(live);
+        in.array(groupIds);
+        in.array(groupRows);
+        in.array(windowOffsets);
+        in.array(abnormalCounts);
+        in.column(arenaPrices);
+        in.column(arenaReturns);
+        in.column(arenaAbnormalReturns);
+        
+        size_t count = live.size();
+        if (!in.ok() || symbolIds.size() != symbolNames.size() || symbols.size() != count ||
+            epsEstimates.size() != count || actualEPS.size() != count || earningsDays.size() != count ||
+            surprises.size() != count || groupIds.size() != count || groupRows.size() != count ||
+            windowOffsets.size() != count || abnormalCounts.size() != count ||
+            arenaReturns.size() != arenaPrices.size() || arenaAbnormalReturns.size() != arenaPrices.size()) {
+            return false;
+        }
+        const size_t length = 2 * window + 2;
+        liveCount = 0;
+        for (EventHandle h = 0; h < count; h++) {
+            if (symbols[h] >= symbolNames.size() || abnormalCounts[h] >= length) return false;
+            if (windowOffsets[h] != NO_WINDOW &&
+                (windowOffsets[h] < 0 || static_cast<size_t>(windowOffsets[h]) + length > arenaPrices.size())) {
+                return false;
+            }
+            liveCount += live[h] != 0;
+        }
+        orderValid = false;
+        return true;
+    }
+};
+
+// Counter-based random stream: draw n is a SplitMix64 hash of (key, n), so a
+// stream is just a key and a counter, costs no syscalls to create, and
+// streams with different keys never overlap. Bootstrapping opens one stream
+// per (iteration, group), so a draw depends only on the seed and its index.
+class CounterRng {
+private:
+    uint64_t key;
+    uint64_t counter;
+    
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    
+public:
+    CounterRng(uint64_t seed, uint64_t stream) : key(mix(seed ^ mix(stream + 0x9E3779B97F4A7C15ULL))), counter(0) {}
+    
+    uint64_t next() {
+        return mix(key + 0x9E3779B97F4A7C15ULL * ++counter);
+    }
+    
+    // Uniform integer in [0, bound), by Lemire's multiply-and-reject method
+    uint32_t below(uint32_t bound) {
+        uint64_t product = (next() >> 32) * bound;
+        uint32_t low = static_cast<uint32_t>(product);
+        if (low < bound) {
+            uint32_t threshold = static_cast<uint32_t>(-bound) % bound;
+            while (low < threshold) {
+                product = (next() >> 32) * bound;
+                low = static_cast<uint32_t>(product);
+            }
+        }
+        return static_cast<uint32_t>(product >> 32);
+    }
+};
+
+// Surprise classifier: a table of cut points, sorted from highest to lowest,
+// splits the surprise percentage into groups numbered from the highest
+// surprise down. A surprise equal to an inclusive cut joins the group above
+// the cut; one equal to an exclusive cut stays in the group below.
+class SurpriseClassifier {
+public:
+    struct Cut {
+        double value;
+        bool inclusive;
+    };
+    
+    std::vector<Cut> cuts;
+    std::vector<std::string> names; // One per group, cuts.size() + 1 in all
+    
+    size_t groupCount() const {
+        return names.size();
+    }
+    
+    // Group id of a surprise percentage, by binary search of the cuts
+    size_t classify(double surprise) const {
+        auto below = std::partition_point(cuts.begin(), cuts.end(), [surprise](const Cut& cut) {
+            return surprise < cut.value || (surprise == cut.value && !cut.inclusive);
+        });
+        return below - cuts.begin();
+    }
+    
+    // Beat above beatAbove, Miss below missBelow, Meet in between
+    static SurpriseClassifier beatMeetMiss(double beatAbove, double missBelow) {
+        SurpriseClassifier classifier;
+        classifier.cuts = {Cut{beatAbove, false}, Cut{missBelow, true}};
+        classifier.names = {"Beat", "Meet", "Miss"};
+        return classifier;
+    }
+    
+    // groups groups of about equal size, cut at quantiles of the given
+    // surprises, named Q<groups> (highest surprise) down to Q1. Ties share
+    // the higher group.
+    static SurpriseClassifier fromQuantiles(std::vector<double> surprises, size_t groups) {
+        SurpriseClassifier classifier;
+        std::sort(surprises.begin(), surprises.end());
+        for (size_t k = groups - 1; k > 0; k--) {
+            double value = surprises.empty() ? 0.0 : surprises[k * surprises.size() / groups];
+            classifier.cuts.push_back(Cut{value, true});
+        }
+        for (size_t k = groups; k > 0; k--) {
+            classifier.names.push_back("Q" + std::to_string(k));
+        }
+        return classifier;
+    }
+};
+
+// Group class to store collections of events, by handle into an EventStore.
+// The group keeps its own copy of the members' abnormal returns as one
+// contiguous events x days matrix, so AAR is a column reduction over
+// adjacent rows and CAAR a prefix scan. It also keeps the per-day sums of the
+// rows, so adding or removing an event updates AAR and CAAR in O(window).
+// With a row capacity, the sums still cover every event added but only a
+// uniform reservoir sample of the rows is kept, bounding memory for
+// streamed runs; such a group can't take events out again.
+class Group {
+public:
+    std::string name;
+    EventStore* store;
+    int32_t id;                      // Group id recorded in the store for members
+    std::vector<EventHandle> events; // Events with a row in the matrix
+    size_t eventCount;               // Events in the sums; more than events.size() once rows are sampled
+    size_t rowCapacity;              // Most rows kept, 0 for no limit
+    size_t windowDays;               // Columns per row, set by the first event
+    MappedColumn eventMatrix;        // Row i holds events[i]'s abnormal returns
+    std::vector<double> sums;        // Per-day sums of the abnormal returns
+    size_t removals;                 // Removals since sums were rebuilt from the rows
+    std::vector<double> aar; // Average Abnormal Return
+    std::vector<double> caar; // Cumulative Average Abnormal Return
+    
+    Group(const std::string& groupName, EventStore* events, int32_t groupId, size_t maxRows = 0)
+        : name(groupName), store(events), id(groupId), eventCount(0), rowCapacity(maxRows), windowDays(0), removals(0) {}
+    
+    // Whether some added events have no row, so sums can't be rebuilt from the rows
+    bool sampled() const {
+        return eventCount > events.size();
+    }
+    
+    // Add an event and copy its abnormal returns into the matrix. Every row
+    // must have the same length, so mismatched events are rejected. Once the
+    // matrix holds rowCapacity rows, the n-th event replaces a random row
+    // with probability rowCapacity / n (reservoir sampling), so the rows stay
+    // a uniform sample of every event added.
+    bool addEvent(EventHandle h) {
+        SeriesView abnormalReturns = store->abnormalReturns(h);
+        if (eventCount == 0) {
+            windowDays = abnormalReturns.size();
+            sums.assign(windowDays, 0.0);
+        }
+        if (abnormalReturns.size() != windowDays) {
+            std::cerr << "Skipping " << store->symbol(h) << " in " << name << " group: expected "
+                      << windowDays << " abnormal returns, got " << abnormalReturns.size() << std::endl;
+            return false;
+        }
+        store->groupIds[h] = id;
+        eventCount++;
+        kernels().accumulate(sums.data(), abnormalReturns.data(), windowDays);
+        
+        if (rowCapacity == 0 || events.size() < rowCapacity) {
+            store->groupRows[h] = static_cast<uint32_t>(events.size());
+            events.push_back(h);
+            std::vector<double>& matrix = eventMatrix.own();
+            matrix.insert(matrix.end(), abnormalReturns.begin(), abnormalReturns.end());
+        } else {
+            CounterRng rng(static_cast<uint64_t>(id), eventCount);
+            uint32_t slot = rng.below(static_cast<uint32_t>(eventCount));
+            if (slot < rowCapacity) {
+                events[slot] = h;
+                store->groupRows[h] = slot;
+                std::copy(abnormalReturns.begin(), abnormalReturns.end(), eventMatrix.own().begin() + slot * windowDays);
+            }
+        }
+        calculateAAR();
+        calculateCAAR();
+        return true;
+    }
+    
+    // Fold in another part of this group, e.g. from another shard: per-day
+    // sums over count events, and rows of days values each for the given
+    // events (all count of them, unless that part was sampled). When either
+    // side is sampled, or the rows would pass the capacity, the kept rows are
+    // redrawn so they stay a uniform sample of the union: each slot comes
+    // from one side with probability proportional to the events that side
+    // still stands for, which never takes more rows than a side has.
+    bool merge(const std::vector<EventHandle>& handles, const double* rows, const double* otherSums,
+               size_t count, size_t days) {
+        if (count == 0) return true;
+        if (windowDays == 0) {
+            windowDays = days;
+            sums.assign(windowDays, 0.0);
+        }
+        if (days != windowDays || handles.size() > count) {
+            std::cerr << "Can't merge into " << name << " group: expected " << windowDays
+                      << " days per row, got " << days << std::endl;
+            return false;
+        }
+        for (EventHandle h : handles) store->groupIds[h] = id;
+        
+        size_t kept = events.size() + handles.size();
+        bool complete = !sampled() && handles.size() == count;
+        if (complete && (rowCapacity == 0 || kept <= rowCapacity)) {
+            events.insert(events.end(), handles.begin(), handles.end());
+            std::vector<double>& matrix = eventMatrix.own();
+            matrix.insert(matrix.end(), rows, rows + handles.size() * windowDays);
+        } else {
+            size_t target = kept;
+            if (rowCapacity > 0) target = std::min(target, rowCapacity);
+            if (sampled()) target = std::min(target, events.size());
+            if (handles.size() < count) target = std::min(target, handles.size());
+            
+            // Draw target rows without replacement, by partial Fisher-Yates on each side
+            const double* sideRows[2] = {eventMatrix.data(), rows};
+            const EventHandle* sideEvents[2] = {events.data(), handles.data()};
+            size_t remaining[2] = {eventCount, count};
+            std::vector<uint32_t> order[2];
+            for (int side = 0; side < 2; side++) {
+                order[side].resize(side == 0 ? events.size() : handles.size());
+                std::iota(order[side].begin(), order[side].end(), 0);
+            }
+            size_t taken[2] = {0, 0};
+            CounterRng rng(~static_cast<uint64_t>(id), eventCount + count);
+            std::vector<EventHandle> mergedEvents;
+            std::vector<double> mergedMatrix;
+            mergedEvents.reserve(target);
+            mergedMatrix.reserve(target * windowDays);
+            for (size_t slot = 0; slot < target; slot++) {
+                int side = rng.below(static_cast<uint32_t>(remaining[0] + remaining[1])) < remaining[0] ? 0 : 1;
+                std::vector<uint32_t>& sideOrder = order[side];
+                size_t pick = taken[side] + rng.below(static_cast<uint32_t>(sideOrder.size() - taken[side]));
+                std::swap(sideOrder[taken[side]], sideOrder[pick]);
+                uint32_t index = sideOrder[taken[side]++];
+                remaining[side]--;
+                mergedEvents.push_back(sideEvents[side][index]);
+                const double* source = sideRows[side] + static_cast<size_t>(index) * windowDays;
+                mergedMatrix.insert(mergedMatrix.end(), source, source + windowDays);
+            }
+            events.swap(mergedEvents);
+            eventMatrix.replace(mergedMatrix);
+        }
+        for (size_t i = 0; i < events.size(); i++) store->groupRows[events[i]] = static_cast<uint32_t>(i);
+        
+        eventCount += count;
+        kernels().accumulate(sums.data(), otherSums, windowDays);
+        calculateAAR();
+        calculateCAAR();
+        return true;
+    }
+    
+    // Remove a member event. The last row moves into its place, and the sums
+    // are rebuilt once removals outnumber the events left, so rounding drift
+    // from subtraction stays bounded at amortized O(window) per removal.
+    // Sampled groups can't remove events.
+    void removeEvent(EventHandle h) {
+        if (store->groupIds[h] != id || sampled()) return;
+        size_t index = store->groupRows[h];
+        size_t last = events.size() - 1;
+        const double* removed = row(index);
+        for (size_t day = 0; day < windowDays; day++) {
+            sums[day] -= removed[day];
+        }
+        std::vector<double>& matrix = eventMatrix.own();
+        if (index != last) {
+            std::copy(row(last), row(last) + windowDays, matrix.begin() + index * windowDays);
+            events[index] = events[last];
+            store->groupRows[events[index]] = static_cast<uint32_t>(index);
+        }
+        events.pop_back();
+        matrix.resize(last * windowDays);
+        store->groupIds[h] = EventStore::NO_GROUP;
+        eventCount--;
+        
+        if (events.empty()) {
+            clear();
+            return;
+        }
+        if (++removals > events.size()) rebuildSums();
+        calculateAAR();
+        calculateCAAR();
+    }
+    
+    // Abnormal returns of the i-th event
+    const double* row(size_t i) const {
+        return eventMatrix.data() + i * windowDays;
+    }
+    
+    // Remove all events and metrics
+    void clear() {
+        if (sampled()) {
+            std::replace(store->groupIds.begin(), store->groupIds.end(), id, EventStore::NO_GROUP);
+        } else {
+            for (EventHandle h : events) store->groupIds[h] = EventStore::NO_GROUP;
+        }
+        events.clear();
+        eventCount = 0;
+        windowDays = 0;
+        eventMatrix.clear();
+        sums.clear();
+        removals = 0;
+        aar.clear();
+        caar.clear();
+    }
+    
+    // Write the group's counts, rows, sums and metrics to a snapshot
+    void writeSnapshot(std::ostream& out) const {
+        writeSnapshotString(out, name);
+        uint64_t counts[4] = {eventCount, rowCapacity, windowDays, removals};
+        writeSnapshotArray(out, counts, 4);
+        writeSnapshotArray(out, events);
+        writeSnapshotArray(out, eventMatrix.data(), eventMatrix.size());
+        writeSnapshotArray(out, sums);
+        writeSnapshotArray(out, aar);
+        writeSnapshotArray(out, caar);
+    }
+    
+    // Read what writeSnapshot wrote, leaving the rows in the mapped file.
+    // False if the file is short, the rows don't match the window, or a row
+    // names an event the store lacks.
+    bool readSnapshot(SnapshotReader& in) {
+        std::vector<uint64_t> counts;
+        if (!in.string(name) || !in.array(counts) || counts.size() != 4) return false;
+        eventCount = counts[0];
+        rowCapacity = counts[1];
+        windowDays = counts[2];
+        removals = counts[3];
+        in.array(events);
+        in.column(eventMatrix);
+        in.array(sums);
+        in.array(aar);
+        in.array(caar);
+        if (!in.ok() || windowDays > 2 * static_cast<size_t>(store->window) + 1 || events.size() > eventCount ||
+            eventMatrix.size() != events.size() * windowDays ||
+            sums.size() != windowDays || aar.size() != windowDays || caar.size() != windowDays) {
+            return false;
+        }
+        for (EventHandle h : events) {
+            if (h >= store->size()) return false;
+        }
+        return true;
+    }
+    
+    // Recompute the per-day sums from the rows, unless rows were sampled
+    void rebuildSums() {
+        if (sampled()) return;
+        sums.assign(windowDays, 0.0);
+        for (size_t i = 0; i < events.size(); i++) {
+            kernels().accumulate(sums.data(), row(i), windowDays);
+        }
+        removals = 0;
+    }
+    
+    // Calculate AAR for the group from the running sums
+    void calculateAAR() {
+        aar.assign(windowDays, 0.0);
+        if (eventCount == 0) return;
+        
+        double scale = 1.0 / eventCount;
+        for (size_t day = 0; day < windowDays; day++) {
+            aar[day] = sums[day] * scale;
+        }
+    }
+    
+    // Calculate CAAR for the group
+    void calculateCAAR() {
+        caar.resize(aar.size());
+        std::partial_sum(aar.begin(), aar.end(), caar.begin());
+    }
+    
+    // Row numbers kept between bootstrap draws, and the swaps of the last draw
+    struct RowSample {
+        std::vector<uint32_t> indices;
+        std::vector<uint32_t> swaps;
+    };
+    
+    // Sample rows for bootstrapping: a partial Fisher-Yates shuffle of
+    // sample.indices leaves a uniform sample without replacement in its first
+    // entries. The previous draw's swaps are undone first, so every draw
+    // starts from the identity permutation and depends only on rng. Takes
+    // every row, unshuffled, when the group has no more than sampleSize events.
+    size_t sampleRows(size_t sampleSize, RowSample& sample, CounterRng& rng) const {
+        uint32_t count = static_cast<uint32_t>(events.size());
+        std::vector<uint32_t>& indices = sample.indices;
+        if (indices.size() != count) {
+            indices.resize(count);
+            std::iota(indices.begin(), indices.end(), 0u);
+            sample.swaps.clear();
+        }
+        for (size_t j = sample.swaps.size(); j-- > 0;) {
+            std::swap(indices[j], indices[sample.swaps[j]]);
+        }
+        sample.swaps.clear();
+        if (sampleSize >= count) return count;
+        
+        for (uint32_t j = 0; j < sampleSize; j++) {
+            uint32_t other = j + rng.below(count - j);
+            std::swap(indices[j], indices[other]);
+            sample.swaps.push_back(other);
+        }
+        return sampleSize;
+    }
+    
+    // Write the CAAR of the given rows to caar, using aar as scratch space
+    void sampleCAAR(const uint32_t* rows, size_t count, std::vector<double>& aar, double* caar) const {
+        aar.assign(windowDays, 0.0);
+        for (size_t j = 0; j < count; j++) {
+            kernels().accumulate(aar.data(), row(rows[j]), windowDays);
+        }
+        
+        double scale = 1.0 / count;
+        double cumulative = 0.0;
+        for (size_t day = 0; day < windowDays; day++) {
+            cumulative += aar[day] * scale;
+            caar[day] = cumulative;
+        }
+    }
+};
+
+// Running count, mean and variance via Welford's update; two partial
+// results merge exactly (Chan et al.)
+struct RunningMoments {
+    uint64_t count = 0;
+    double mean = 0.0;
+    double m2 = 0.0; // Sum of squared deviations from the mean
+    
+    void add(double value) {
+        count++;
+        double delta = value - mean;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+    }
+    
+    void merge(const RunningMoments& other) {
+        if (other.count == 0) return;
+        uint64_t total = count + other.count;
+        double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * (static_cast<double>(count) * other.count / total);
+        count = total;
+    }
+    
+    // Sample standard deviation
+    double stddev() const {
+        return count > 1 ? std::sqrt(m2 / (count - 1)) : 0.0;
+    }
+};
+
+// Merging t-digest (Dunning): a fixed-size sketch of a distribution that
+// answers quantile queries, accurate in the tails, and merges across threads.
+// Values are buffered and folded into the centroids in sorted batches.
+class TDigest {
+private:
+    struct Centroid {
+        double mean;
+        double weight;
+    };
+    
+    double compression;
+    std::vector<Centroid> centroids; // Sorted by mean
+    std::vector<Centroid> scratch;
+    std::vector<double> buffer;
+    double totalWeight;
+    double minimum;
+    double maximum;
+    
+    // Scale function k1: centroids near the tails stay small
+    double scale(double q) const {
+        const double pi = 3.14159265358979323846;
+        return compression / (2.0 * pi) * std::asin(2.0 * std::min(1.0, std::max(0.0, q)) - 1.0);
+    }
+    
+    // Fold buffered values into the centroids
+    void compress() {
+        if (buffer.empty()) return;
+        std::sort(buffer.begin(), buffer.end());
+        
+        scratch.clear();
+        double total = totalWeight + buffer.size();
+        double weightSoFar = 0.0;
+        double limit = scale(0.0);
+        size_t c = 0, b = 0;
+        while (c < centroids.size() || b < buffer.size()) {
+            Centroid next;
+            if (b == buffer.size() || (c < centroids.size() && centroids[c].mean <= buffer[b])) {
+                next = centroids[c++];
+            } else {
+                next = Centroid{buffer[b++], 1.0};
+            }
+            
+            if (!scratch.empty() && scale((weightSoFar + next.weight) / total) - limit <= 1.0) {
+                Centroid& last = scratch.back();
+                last.weight += next.weight;
+                last.mean += (next.mean - last.mean) * next.weight / last.weight;
+            } else {
+                if (!scratch.empty()) limit = scale(weightSoFar / total);
+                scratch.push_back(next);
+            }
+            weightSoFar += next.weight;
+        }
+        
+        centroids.swap(scratch);
+        totalWeight = total;
+        buffer.clear();
+    }
+    
+public:
+    explicit TDigest(double compressionFactor = 100.0)
+        : compression(compressionFactor), totalWeight(0.0),
+          minimum(std::numeric_limits<double>::infinity()), maximum(-std::numeric_limits<double>::infinity()) {
+        buffer.reserve(static_cast<size_t>(compression * 10));
+    }
+    
+    void clear() {
+        centroids.clear();
+        buffer.clear();
+        totalWeight = 0.0;
+        minimum = std::numeric_limits<double>::infinity();
+        maximum = -std::numeric_limits<double>::infinity();
+    }
+    
+    void add(double value) {
+        buffer.push_back(value);
+        minimum = std::min(minimum, value);
+        maximum = std::max(maximum, value);
+        if (buffer.size() == buffer.capacity()) compress();
+    }
+    
+    void merge(TDigest& other) {
+        other.compress();
+        compress();
+        if (other.centroids.empty()) return;
+        
+        scratch.resize(centroids.size() + other.centroids.size());
+        std::merge(centroids.begin(), centroids.end(), other.centroids.begin(), other.centroids.end(), scratch.begin(),
+                   [](const Centroid& a, const Centroid& b) { return a.mean < b.mean; });
+        centroids.clear();
+        double total = totalWeight + other.totalWeight;
+        double weightSoFar = 0.0;
+        double limit = scale(0.0);
+        for (const Centroid& next : scratch) {
+            if (!centroids.empty() && scale((weightSoFar + next.weight) / total) - limit <= 1.0) {
+                Centroid& last = centroids.back();
+                last.weight += next.weight;
+                last.mean += (next.mean - last.mean) * next.weight / last.weight;
+            } else {
+                if (!centroids.empty()) limit = scale(weightSoFar / total);
+                centroids.push_back(next);
+            }
+            weightSoFar += next.weight;
+        }
+        totalWeight = total;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+    }
+    
+    // Estimate the q-th quantile, 0 <= q <= 1, interpolating between centroid centers
+    double quantile(double q) {
+        compress();
+        if (centroids.empty()) return std::numeric_limits<double>::quiet_NaN();
+        if (centroids.size() == 1) return centroids[0].mean;
+        
+        double target = q * totalWeight;
+        double cumulative = 0.0;
+        for (size_t i = 0; i < centroids.size(); i++) {
+            double center = cumulative + centroids[i].weight / 2.0;
+            if (target < center) {
+                if (i == 0) {
+                    // Between the minimum and the first centroid
+                    double fraction = center > 0 ? target / center : 0.0;
+                    return minimum + (centroids[0].mean - minimum) * fraction;
+                }
+                double previousCenter = cumulative - centroids[i - 1].weight / 2.0;
+                double fraction = (target - previousCenter) / (center - previousCenter);
+                return centroids[i - 1].mean + (centroids[i].mean - centroids[i - 1].mean) * fraction;
+            }
+            cumulative += centroids[i].weight;
+        }
+        
+        // Between the last centroid and the maximum
+        double lastCenter = totalWeight - centroids.back().weight / 2.0;
+        double fraction = totalWeight > lastCenter ? (target - lastCenter) / (totalWeight - lastCenter) : 1.0;
+        return centroids.back().mean + (maximum - centroids.back().mean) * std::min(1.0, fraction);
+    }
+};
+
+// Streaming per-day statistics of bootstrapped CAAR for one group: mean and
+// standard error from running moments, 95% bands from t-digests. Memory is
+// fixed by the window length, not the number of iterations.
+class BootstrapStats {
+public:
+    std::vector<RunningMoments> moments;
+    std::vector<TDigest> digests;
+    
+    explicit BootstrapStats(size_t windowDays = 0) : moments(windowDays), digests(windowDays) {}
+    
+    size_t days() const {
+        return moments.size();
+    }
+    
+    void clear() {
+        for (size_t day = 0; day < moments.size(); day++) {
+            moments[day] = RunningMoments();
+            digests[day].clear();
+        }
+    }
+    
+    // Record one iteration's CAAR
+    void add(const double* caar) {
+        for (size_t day = 0; day < moments.size(); day++) {
+            moments[day].add(caar[day]);
+            digests[day].add(caar[day]);
+        }
+    }
+    
+    void merge(BootstrapStats& other) {
+        for (size_t day = 0; day < moments.size(); day++) {
+            moments[day].merge(other.moments[day]);
+            digests[day].merge(other.digests[day]);
+        }
+    }
+};
+
+// Table formats the exports can be written in
+enum ExportFormat {
+    EXPORT_CSV,
+    EXPORT_NPY
+};
+
+// Buffered writer for exported tables. CSV rows are formatted with
+// std::to_chars into one large buffer; NPY writes a directory holding one
+// .npy file per column, which numpy can map with np.load(path, mmap_mode="r").
+// Fields are written left to right, one row at a time.
+class TableWriter {
+public:
+    enum ColumnType {
+        NUMBER,  // float64
+        INTEGER, // int32
+        TEXT     // fixed-width bytes, zero padded
+    };
+    
+    struct Column {
+        std::string name;
+        ColumnType type;
+        size_t width; // bytes, for TEXT columns
+    };
+    
+    static constexpr size_t BUFFER_BYTES = 1 << 20;
+    static constexpr size_t NPY_HEADER_BYTES = 128;
+    
+private:
+    struct ColumnFile {
+        std::ofstream file;
+        std::string buffer;
+    };
+    
+    ExportFormat format;
+    int precision; // significant digits in CSV, 0 for the shortest exact form
+    std::string path;
+    std::vector<Column> columns;
+    std::ofstream file;
+    std::string buffer;
+    std::vector<ColumnFile> columnFiles;
+    size_t column = 0;
+    uint64_t rows = 0;
+    
+    // Numpy's description of a column's element type
+    static std::string descriptor(const Column& c) {
+        if (c.type == NUMBER) return "<f8";
+        if (c.type == INTEGER) return "<i4";
+        return "|S" + std::to_string(c.width);
+    }
+    
+    // A version 1.0 .npy header padded to NPY_HEADER_BYTES, so the row count
+    // can be filled in once it is known
+    static std::string npyHeader(const Column& c, uint64_t rowCount) {
+        std::string dict = "{'descr': '" + descriptor(c) + "', 'fortran_order': False, 'shape': (" +
+                           std::to_string(rowCount) + ",), }";
+        std::string header("\x93NUMPY\x01\x00", 8);
+        uint16_t length = static_cast<uint16_t>(NPY_HEADER_BYTES - 10);
+        header += static_cast<char>(length & 0xff);
+        header += static_cast<char>(length >> 8);
+        header += dict;
+        header.resize(NPY_HEADER_BYTES - 1, ' ');
+        header += '\n';
+        return header;
+    }
+    
+    // Start the next CSV field, or get the current column's buffer for NPY
+    std::string& field() {
+        if (format == EXPORT_NPY) return columnFiles[column++].buffer;
+        if (column++ > 0) buffer += ',';
+        return buffer;
+    }
+    
+    static bool drain(std::ofstream& out, std::string& pending) {
+        out.write(pending.data(), pending.size());
+        pending.clear();
+        return static_cast<bool>(out);
+    }
+    
+public:
+    explicit TableWriter(ExportFormat tableFormat = EXPORT_CSV, int digits = 6)
+        : format(tableFormat), precision(digits) {}
+    
+    TableWriter(const TableWriter&) = delete;
+    TableWriter& operator=(const TableWriter&) = delete;
+    
+    // Create the table and write the CSV header
+    bool open(const std::string& filename, const std::vector<Column>& tableColumns) {
+        path = filename;
+        columns = tableColumns;
+        column = 0;
+        rows = 0;
+        buffer.clear();
+        columnFiles.clear();
+        
+        if (format == EXPORT_CSV) {
+            file.open(path, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                std::cerr << "Failed to open file for writing: " << path << std::endl;
+                return false;
+            }
+            for (size_t i = 0; i < columns.size(); i++) {
+                if (i > 0) buffer += ',';
+                buffer += columns[i].name;
+            }
+            buffer += '\n';
+            buffer.reserve(BUFFER_BYTES + 256);
+            return true;
+        }
+        
+#ifdef _WIN32
+        _mkdir(path.c_str());
+#else
+        mkdir(path.c_str(), 0755);
+#endif
+        columnFiles.resize(columns.size());
+        for (size_t i = 0; i < columns.size(); i++) {
+            std::string name = path + "/" + columns[i].name + ".npy";
+            ColumnFile& out = columnFiles[i];
+            out.file.open(name, std::ios::binary | std::ios::trunc);
+            if (!out.file.is_open()) {
+                std::cerr << "Failed to open file for writing: " << name << std::endl;
+                columnFiles.clear();
+                return false;
+            }
+            out.buffer = npyHeader(columns[i], 0);
+        }
+        return true;
+    }
+    
+    void number(double value) {
+        std::string& out = field();
+        if (format == EXPORT_NPY) {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            return;
+        }
+        char text[32];
+        std::to_chars_result result = precision > 0
+            ? std::to_chars(text, text + sizeof(text), value, std::chars_format::general, precision)
+            : std::to_chars(text, text + sizeof(text), value);
+        out.append(text, result.ptr - text);
+    }
+    
+    void integer(int32_t value) {
+        std::string& out = field();
+        if (format == EXPORT_NPY) {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            return;
+        }
+        char text[16];
+        std::to_chars_result result = std::to_chars(text, text + sizeof(text), value);
+        out.append(text, result.ptr - text);
+    }
+    
+    void text(std::string_view value) {
+        if (format == EXPORT_NPY) {
+            size_t width = columns[column].width;
+            std::string& out = field();
+            size_t used = std::min(width, value.size());
+            out.append(value.data(), used);
+            out.append(width - used, '\0');
+            return;
+        }
+        field().append(value.data(), value.size());
+    }
+    
+    // A missing value: an empty CSV field, NaN or zero in NPY
+    void missing() {
+        if (format == EXPORT_CSV) {
+            field();
+            return;
+        }
+        const Column& c = columns[column];
+        if (c.type == NUMBER) number(std::numeric_limits<double>::quiet_NaN());
+        else if (c.type == INTEGER) integer(0);
+        else text("");
+    }
+    
+    // Finish the row, writing out any buffer that has filled up
+    bool endRow() {
+        column = 0;
+        rows++;
+        if (format == EXPORT_CSV) {
+            buffer += '\n';
+            return buffer.size() < BUFFER_BYTES || drain(file, buffer);
+        }
+        bool ok = true;
+        for (ColumnFile& out : columnFiles) {
+            if (out.buffer.size() >= BUFFER_BYTES) ok = drain(out.file, out.buffer) && ok;
+        }
+        return ok;
+    }
+    
+    uint64_t rowCount() const {
+        return rows;
+    }
+    
+    // Flush the buffers and, for NPY, record the row count in each header
+    bool close() {
+        bool ok = true;
+        if (format == EXPORT_CSV) {
+            if (!file.is_open()) return false;
+            ok = drain(file, buffer);
+            file.close();
+            ok = ok && static_cast<bool>(file);
+        } else {
+            if (columnFiles.empty()) return false;
+            for (size_t i = 0; i < columnFiles.size(); i++) {
+                ColumnFile& out = columnFiles[i];
+                ok = drain(out.file, out.buffer) && ok;
+                std::string header = npyHeader(columns[i], rows);
+                out.file.seekp(0);
+                out.file.write(header.data(), header.size());
+                out.file.close();
+                ok = ok && static_cast<bool>(out.file);
+            }
+            columnFiles.clear();
+        }
+        if (!ok) std::cerr << "Failed to write " << path << std::endl;
+        return ok;
+    }
+};
+
+// Called once per requested symbol with its index, whether the source
+// answered (false for a failed request), and its bars inside the requested
+// range, oldest first
+typedef std::function<void(size_t, bool, PriceSeries&)> PriceCallback;
+
+// Source of daily adjusted closes. startBatch hands every request of a
+// batch to the fetch engine and returns; as the engine's thread drives it,
+// each symbol is reported through onComplete as soon as its bars are in, in
+// any order but never two calls at a time, and onDone follows once every
+// symbol has been. A throwing onComplete ends the batch early: its other
+// symbols go unreported and onDone receives the exception. Providers that
+// need no engine may finish the whole batch before returning.
+class MarketDataProvider {
+protected:
+    // Whether a transfer failed before its body is worth reading, and if so
+    // whether asking again could help
+    static bool transferFailed(CURLcode result, long status, FetchEngine::Outcome& outcome) {
+        switch (result) {
+        case CURLE_OK:
+            break;
+        case CURLE_UNSUPPORTED_PROTOCOL:
+        case CURLE_URL_MALFORMAT:
+        case CURLE_FAILED_INIT:
+        case CURLE_WRITE_ERROR:
+        case CURLE_OUT_OF_MEMORY:
+            outcome = FetchEngine::DONE;
+            return true;
+        default:
+            outcome = FetchEngine::RETRY;
+            return true;
+        }
+        if (status < 400) return false;
+        if (status == 429) outcome = FetchEngine::THROTTLED;
+        else if (status >= 500) outcome = FetchEngine::RETRY;
+        else outcome = FetchEngine::DONE;
+        return true;
+    }
+    
+public:
+    virtual ~MarketDataProvider() {}
+    
+    virtual std::string name() const = 0;
+    
+    // Whether fetched bars are worth keeping in the price cache
+    virtual bool cacheable() const {
+        return true;
+    }
+    
+    virtual void setApiKey(const std::string&) {}
+    
+    virtual void startBatch(const std::vector<std::string>& symbols, const std::vector<DateRange>& ranges,
+                            const PriceCallback& onComplete, const FetchEngine::FinishHandler& onDone) = 0;
+};
+
+// Alpha Vantage's daily adjusted series, one request per symbol, parsed
+// while it downloads
+class AlphaVantageProvider : public MarketDataProvider {
+private:
+    // A batch's state, shared by the engine callbacks that outlive startBatch
+    struct Batch {
+        std::vector<std::string> symbols;
+        std::vector<DateRange> ranges;
+        std::vector<std::unique_ptr<PriceStreamParser>> parsers;
+        PriceCallback onComplete;
+    };
+    
+    std::string apiKey;
+    FetchEngine& engine;
+    
+    std::string buildUrl(const std::string& symbol, bool compact) const {
+        return "https://www.alphavantage.co/query?function=TIME_SERIES_DAILY_ADJUSTED"
+               "&symbol=" + symbol + 
+               "&apikey=" + apiKey + 
+               "&outputsize=" + (compact ? "compact" : "full") +
+               "&datatype=csv";
+    }
+    
+    // Decide whether a finished request is worth repeating. Connection
+    // problems and server errors are retried; HTTP 429 and Alpha Vantage's
+    // JSON "Note"/"Information" bodies mean we are over the request rate.
+    // Bad symbols, a bad key, premium-only endpoints and an exhausted daily
+    // quota won't improve by asking again.
+    static FetchEngine::Outcome classifyResponse(CURLcode result, long status, const PriceStreamParser& parser) {
+        FetchEngine::Outcome outcome;
+        if (transferFailed(result, status, outcome)) return outcome;
+        if (parser.receivedCsv()) return FetchEngine::DONE;
+        
+        const std::string& body = parser.unexpectedResponse();
+        if (body.empty()) return FetchEngine::RETRY; // Empty body
+        if (body.find("Error Message") != std::string::npos) return FetchEngine::DONE;
+        if (body.find("premium") != std::string::npos) return FetchEngine::DONE;
+        if (body.find("per day") != std::string::npos) return FetchEngine::DONE;
+        if (body.find("\"Note\"") != std::string::npos || body.find("\"Information\"") != std::string::npos ||
+            body.find("rate limit") != std::string::npos) {
+            return FetchEngine::THROTTLED;
+        }
+        return FetchEngine::RETRY;
+    }
+    
+    static std::string describeFailure(CURLcode result, long status, const PriceStreamParser& parser) {
+        if (result != CURLE_OK) return curl_easy_strerror(result);
+        if (status >= 400) return "HTTP " + std::to_string(status);
+        if (parser.unexpectedResponse().empty()) return "empty response";
+        return parser.unexpectedResponse();
+    }
+    
+    // Complete a streamed parse, report problems and release the parser;
+    // a request that never got a handle has no parser and yields nothing
+    static PriceSeries finishParse(const std::string& symbol, std::unique_ptr<PriceStreamParser>& parser) {
+        if (!parser) return PriceSeries();
+        parser->finish();
+        parser->parseReport().print(symbol);
+        if (!parser->unexpectedResponse().empty()) {
+            std::cerr << "Unexpected response for " << symbol << ": " << parser->unexpectedResponse() << std::endl;
+            metrics().add(Metrics::UNEXPECTED_RESPONSES);
+        }
+        PriceSeries series = parser->takeSeries();
+        parser.reset();
+        return series;
+    }
+    
+public:
+    // Compact output holds the latest 100 bars, roughly this many calendar days
+    static constexpr int COMPACT_SPAN_DAYS = 135;
+    
+    AlphaVantageProvider(FetchEngine& fetchEngine, const std::string& key) : apiKey(key), engine(fetchEngine) {}
+    
+    std::string name() const override {
+        return "alphavantage";
+    }
+    
+    void setApiKey(const std::string& key) override {
+        apiKey = key;
+    }
+    
+    // Recent ranges ask for compact output; the rest are trimmed to the
+    // range while parsing
+    void startBatch(const std::vector<std::string>& symbols, const std::vector<DateRange>& ranges,
+                    const PriceCallback& onComplete, const FetchEngine::FinishHandler& onDone) override {
+        int today = currentDay();
+        std::vector<std::string> urls;
+        for (size_t i = 0; i < symbols.size(); i++) {
+            urls.push_back(buildUrl(symbols[i], ranges[i].first >= today - COMPACT_SPAN_DAYS));
+        }
+        std::shared_ptr<Batch> batch(new Batch{symbols, ranges, std::vector<std::unique_ptr<PriceStreamParser>>(symbols.size()),
+                                               onComplete});
+        
+        engine.submit(urls, [batch](size_t k) {
+            batch->parsers[k].reset(new PriceStreamParser(batch->ranges[k]));
+            return batch->parsers[k].get();
+        }, [batch](size_t k, CURLcode result, long status, bool lastAttempt) {
+            std::unique_ptr<PriceStreamParser>& parser = batch->parsers[k];
+            if (!parser) {
+                PriceSeries empty;
+                batch->onComplete(k, false, empty);
+                return FetchEngine::DONE;
+            }
+            FetchEngine::Outcome outcome = classifyResponse(result, status, *parser);
+            if (outcome != FetchEngine::DONE && !lastAttempt) {
+                std::cerr << "Retrying " << batch->symbols[k] << ": " << describeFailure(result, status, *parser) << std::endl;
+                parser.reset();
+                return outcome;
+            }
+            bool received = parser->receivedCsv() && result == CURLE_OK && status < 400;
+            PriceSeries series = finishParse(batch->symbols[k], parser);
+            batch->onComplete(k, received, series);
+            return FetchEngine::DONE;
+        }, onDone);
+    }
+};
+
+// Prices from a local snapshot directory: <dir>/<SYMBOL>.csv in the Alpha
+// Vantage daily adjusted layout (newest or oldest bar first), or else the
+// symbol's bars in a price store, <dir>/prices.bin, such as a copy of the
+// price cache. Files are memory-mapped, so backtests run at disk speed
+// and need no network or key. The directory is only ever read: the store
+// is opened read-only, so a journal left beside it is not replayed.
+class LocalDirectoryProvider : public MarketDataProvider {
+private:
+    std::string directory;
+    PriceCache store;
+    
+    void readBatch(const std::vector<std::string>& symbols, const std::vector<DateRange>& ranges,
+                   const PriceCallback& onComplete) {
+        for (size_t i = 0; i < symbols.size(); i++) {
+            std::string path = directory + "/" + symbols[i] + ".csv";
+            PriceSeries series;
+            bool found = false;
+            MappedFile file;
+            CachedSeries entry;
+            if (file.open(path)) {
+                PriceStreamParser parser(ranges[i]);
+                parser.write(file.data(), file.size());
+                parser.finish();
+                parser.parseReport().print(path);
+                found = parser.receivedCsv();
+                series = parser.takeSeries();
+            } else if (store.load(symbols[i], entry)) {
+                found = true;
+                series = sliceSeries(entry.series, ranges[i]);
+            }
+            if (!found) std::cerr << "No local prices for " << symbols[i] << " in " << directory << std::endl;
+            onComplete(i, found, series);
+        }
+    }
+    
+public:
+    explicit LocalDirectoryProvider(const std::string& dir) : directory(dir), store(dir, true) {}
+    
+    std::string name() const override {
+        return "local:" + directory;
+    }
+    
+    bool cacheable() const override {
+        return false;
+    }
+    
+    // Reads the whole batch before returning
+    void startBatch(const std::vector<std::string>& symbols, const std::vector<DateRange>& ranges,
+                    const PriceCallback& onComplete, const FetchEngine::FinishHandler& onDone) override {
+        try {
+            readBatch(symbols, ranges, onComplete);
+        } catch (...) {
+            onDone(std::current_exception());
+            return;
+        }
+        onDone(nullptr);
+    }
+};
+
+// Prices from a vendor endpoint that serves many symbols per request, so a
+// batch costs one round trip per symbolsPerRequest symbols rather than one
+// per symbol. In the URL template, {symbols} becomes the batch's symbols,
+// comma separated, {start} and {end} the dates spanning their ranges
+// (YYYY-MM-DD, empty when unbounded) and {key} the API key. The response
+// is one CSV with a symbol, a date (timestamp or date) and an adjusted close
+// (adjusted_close or close) column, rows in any order.
+class BulkProvider : public MarketDataProvider {
+private:
+    // Collects a whole response body
+    class BodySink : public ResponseSink {
+    public:
+        std::string body;
+        
+        bool write(const char* data, size_t size) override {
+            body.append(data, size);
+            return true;
+        }
+    };
+    
+    // A batch's state, shared by the engine callbacks that outlive startBatch
+    struct Batch {
+        std::vector<std::string> symbols;
+        std::vector<DateRange> ranges;
+        std::vector<size_t> firsts; // Request k holds symbols firsts[k] up to firsts[k + 1]
+        std::vector<std::unique_ptr<BodySink>> bodies;
+        PriceCallback onComplete;
+    };
+    
+    std::string urlTemplate;
+    std::string apiKey;
+    FetchEngine& engine;
+    size_t symbolsPerRequest;
+    
+    static void replaceAll(std::string& text, const std::string& from, const std::string& to) {
+        for (size_t at = text.find(from); at != std::string::npos; at = text.find(from, at + to.size())) {
+            text.replace(at, from.size(), to);
+        }
+    }
+    
+    std::string buildUrl(const std::string& symbolList, const DateRange& range) const {
+        std::string url = urlTemplate;
+        replaceAll(url, "{symbols}", symbolList);
+        replaceAll(url, "{start}", range.first == std::numeric_limits<int>::min() ? "" : formatDate(range.first));
+        replaceAll(url, "{end}", range.last == std::numeric_limits<int>::max() ? "" : formatDate(range.last));
+        replaceAll(url, "{key}", apiKey);
+        return url;
+    }
+    
+    // Split a body among the batch's symbols, keeping each one's bars inside
+    // its own range, oldest first. False if the body isn't CSV.
+    static bool parseBody(std::string_view data, const std::vector<std::string>& symbols,
+                          const std::vector<DateRange>& ranges, size_t first, std::vector<PriceSeries>& series,
+                          ParseReport& report) {
+        std::string_view line;
+        size_t start = data.find_first_not_of(" \t\r\n");
+        if (start == std::string_view::npos || data[start] == '{' || !nextLine(data, line)) return false;
+        int symbolColumn = findColumn(line, "symbol", 0);
+        int dateColumn = findColumn(line, "timestamp", findColumn(line, "date", 1));
+        int closeColumn = findColumn(line, "adjusted_close", findColumn(line, "close", 2));
+        int lastColumn = std::max(symbolColumn, std::max(dateColumn, closeColumn));
+        
+        std::map<std::string_view, size_t> members;
+        for (size_t j = 0; j < series.size(); j++) members[symbols[first + j]] = j;
+        
+        std::vector<std::string_view> fields(lastColumn + 1);
+        for (size_t row = 2; nextLine(data, line); row++) {
+            if (line.empty()) continue;
+            int column = 0;
+            while (column <= lastColumn && !line.empty()) fields[column++] = nextField(line);
+            if (column <= lastColumn) {
+                report.addError(row, column + 1, "missing field");
+                continue;
+            }
+            auto member = members.find(trimField(fields[symbolColumn]));
+            if (member == members.end()) continue;
+            int day;
+            double price;
+            if (!parseDate(trimField(fields[dateColumn]), day)) {
+                report.addError(row, dateColumn + 1, "invalid date");
+                continue;
+            }
+            if (!ranges[first + member->second].contains(day)) continue;
+            if (!parseNumber(fields[closeColumn], price)) {
+                report.addError(row, closeColumn + 1, "invalid adjusted close");
+                continue;
+            }
+            series[member->second].dates.push_back(day);
+            series[member->second].prices.push_back(price);
+            report.rowsParsed++;
+        }
+        
+        for (PriceSeries& s : series) {
+            if (std::is_sorted(s.dates.begin(), s.dates.end())) continue;
+            std::vector<std::pair<int, double>> bars;
+            for (size_t b = 0; b < s.dates.size(); b++) bars.emplace_back(s.dates[b], s.prices[b]);
+            std::sort(bars.begin(), bars.end());
+            for (size_t b = 0; b < bars.size(); b++) {
+                s.dates[b] = bars[b].first;
+                s.prices[b] = bars[b].second;
+            }
+        }
+        return true;
+    }
+    
+public:
+    static constexpr size_t DEFAULT_SYMBOLS_PER_REQUEST = 100;
+    
+    BulkProvider(FetchEngine& fetchEngine, const std::string& url, const std::string& key,
+                 size_t perRequest = DEFAULT_SYMBOLS_PER_REQUEST)
+        : urlTemplate(url), apiKey(key), engine(fetchEngine), symbolsPerRequest(std::max<size_t>(1, perRequest)) {}
+    
+    std::string name() const override {
+        return "bulk:" + urlTemplate;
+    }
+    
+    void setApiKey(const std::string& key) override {
+        apiKey = key;
+    }
+    
+    void startBatch(const std::vector<std::string>& symbols, const std::vector<DateRange>& ranges,
+                    const PriceCallback& onComplete, const FetchEngine::FinishHandler& onDone) override {
+        std::shared_ptr<Batch> batch(new Batch{symbols, ranges, std::vector<size_t>(), std::vector<std::unique_ptr<BodySink>>(),
+                                               onComplete});
+        std::vector<std::string> urls;
+        std::vector<size_t>& firsts = batch->firsts;
+        for (size_t first = 0; first < symbols.size(); first += symbolsPerRequest) {
+            size_t last = std::min(symbols.size(), first + symbolsPerRequest);
+            std::string symbolList;
+            DateRange span = ranges[first];
+            for (size_t i = first; i < last; i++) {
+                if (i > first) symbolList += ',';
+                symbolList += symbols[i];
+                span.first = std::min(span.first, ranges[i].first);
+                span.last = std::max(span.last, ranges[i].last);
+            }
+            urls.push_back(buildUrl(symbolList, span));
+            firsts.push_back(first);
+        }
+        firsts.push_back(symbols.size());
+        batch->bodies.resize(urls.size());
+        
+        engine.submit(urls, [batch](size_t k) {
+            batch->bodies[k].reset(new BodySink());
+            return batch->bodies[k].get();
+        }, [batch](size_t k, CURLcode result, long status, bool lastAttempt) {
+            const std::vector<std::string>& symbols = batch->symbols;
+            std::unique_ptr<BodySink>& body = batch->bodies[k];
+            size_t first = batch->firsts[k], count = batch->firsts[k + 1] - first;
+            FetchEngine::Outcome outcome = FetchEngine::DONE;
+            bool failed = transferFailed(result, status, outcome);
+            if (!failed && body->body.empty()) {
+                failed = true;
+                outcome = FetchEngine::RETRY;
+            }
+            if (failed && outcome != FetchEngine::DONE && !lastAttempt) {
+                std::string reason = result != CURLE_OK ? curl_easy_strerror(result)
+                                   : status >= 400 ? "HTTP " + std::to_string(status) : "empty response";
+                std::cerr << "Retrying " << count << " symbol(s) from " << symbols[first] << ": " << reason << std::endl;
+                body.reset();
+                return outcome;
+            }
+            
+            std::vector<PriceSeries> series(count);
+            ParseReport report;
+            bool received = !failed && parseBody(body->body, symbols, batch->ranges, first, series, report);
+            report.print("bulk response for " + symbols[first]);
+            if (!failed && !received) {
+                std::cerr << "Unexpected bulk response: " << body->body.substr(0, 512) << std::endl;
+                metrics().add(Metrics::UNEXPECTED_RESPONSES);
+            }
+            body.reset();
+            for (size_t j = 0; j < count; j++) batch->onComplete(first + j, received, series[j]);
+            return FetchEngine::DONE;
+        }, onDone);
+    }
+};
+
+// MarketData class to handle market data: a provider behind the price cache
+class MarketData {
+private:
+    std::string apiKey;
+    CurlHandlePool handles;
+    FetchEngine engine;
+    PriceCache cache;
+    std::unique_ptr<MarketDataProvider> provider;
+    std::mutex cacheMutex; // The fetch loop's cache reads and writes against flushes from other threads
+    
+    // Batches queued for the fetch loop thread
+    struct AsyncBatch {
+        std::vector<std::string> symbols;
+        std::vector<DateRange> ranges;
+        std::function<void(size_t, PriceSeries&)> onComplete;
+        FetchEngine::FinishHandler onDone;
+    };
+    std::mutex asyncMutex;
+    std::condition_variable asyncReady;
+    std::vector<AsyncBatch> asyncQueue;
+    std::thread asyncThread;
+    bool asyncStopping;
+    
+    struct FetchPlan {
+        size_t index;
+        DateRange fetch;
+    };
+    
+    // A batch the fetch loop is serving, and the cache entries its fetches merge into
+    struct ServedBatch {
+        AsyncBatch batch;
+        std::vector<CachedSeries> cached;
+    };
+    
+    // Whether a cache entry already answers a request: it must reach back to
+    // the start of the range and forward to its end, or to the last completed
+    // trading day for ranges that run up to today
+    static bool covers(const CachedSeries& entry, const DateRange& range, int today) {
+        if (entry.coverage.first > range.first) return false;
+        if (entry.coverage.last >= std::min(range.last, today)) return true;
+        return !entry.series.empty() && entry.series.lastDate() >= std::min(range.last, previousWeekday(today));
+    }
+    
+    // Combine newly fetched bars with a cached entry. Returns false if the
+    // overlapping bars disagree, meaning the history was re-adjusted (split or
+    // dividend) and the cached bars can't be kept.
+    static bool mergeFetched(CachedSeries& entry, PriceSeries& fetched, const DateRange& fetchedRange) {
+        bool touching = fetchedRange.first <= entry.coverage.last + 1 && entry.coverage.first <= fetchedRange.last + 1;
+        if (entry.series.empty() || !touching) {
+            entry.series = std::move(fetched);
+            entry.coverage = fetchedRange;
+            return true;
+        }
+        
+        std::vector<int>& dates = entry.series.dates;
+        std::vector<double>& prices = entry.series.prices;
+        for (size_t j = 0; j < fetched.dates.size(); j++) {
+            if (!entry.coverage.contains(fetched.dates[j])) continue;
+            size_t i = std::lower_bound(dates.begin(), dates.end(), fetched.dates[j]) - dates.begin();
+            if (i == dates.size() || dates[i] != fetched.dates[j] ||
+                std::abs(prices[i] - fetched.prices[j]) > 1e-6 * std::abs(fetched.prices[j])) {
+                return false;
+            }
+        }
+        
+        // Cached bars before the fetched range, the fetched bars, then cached bars after it
+        size_t lo = std::lower_bound(dates.begin(), dates.end(), fetchedRange.first) - dates.begin();
+        size_t hi = std::upper_bound(dates.begin(), dates.end(), fetchedRange.last) - dates.begin();
+        PriceSeries merged;
+        merged.dates.reserve(lo + fetched.dates.size() + dates.size() - hi);
+        merged.prices.reserve(merged.dates.capacity());
+        merged.dates.insert(merged.dates.end(), dates.begin(), dates.begin() + lo);
+        merged.prices.insert(merged.prices.end(), prices.begin(), prices.begin() + lo);
+        merged.dates.insert(merged.dates.end(), fetched.dates.begin(), fetched.dates.end());
+        merged.prices.insert(merged.prices.end(), fetched.prices.begin(), fetched.prices.end());
+        merged.dates.insert(merged.dates.end(), dates.begin() + hi, dates.end());
+        merged.prices.insert(merged.prices.end(), prices.begin() + hi, prices.end());
+        
+        entry.series = std::move(merged);
+        entry.coverage = DateRange{std::min(entry.coverage.first, fetchedRange.first),
+                                   std::max(entry.coverage.last, fetchedRange.last)};
+        return true;
+    }
+    
+    // Start one round of fetches, merging each into the cache as it
+    // completes. Entries whose cached history turned out to be re-adjusted
+    // are fetched again in a second round; the batch is done after that.
+    void runFetches(const std::shared_ptr<ServedBatch>& served, const std::vector<FetchPlan>& plans, bool retryRound) {
+        const AsyncBatch& batch = served->batch;
+        std::vector<std::string> planSymbols;
+        std::vector<DateRange> planRanges;
+        for (const FetchPlan& plan : plans) {
+            planSymbols.push_back(batch.symbols[plan.index]);
+            planRanges.push_back(plan.fetch);
+        }
+        std::shared_ptr<std::vector<FetchPlan>> retries = std::make_shared<std::vector<FetchPlan>>();
+        
+        provider->startBatch(planSymbols, planRanges, [this, served, plans, retries](size_t k, bool received, PriceSeries& fetched) {
+            const AsyncBatch& batch = served->batch;
+            const FetchPlan& plan = plans[k];
+            size_t i = plan.index;
+            CachedSeries& entry = served->cached[i];
+            
+            if (!received) {
+                if (!entry.series.empty()) {
+                    std::cerr << "Fetch failed for " << batch.symbols[i] << ", using cached prices" << std::endl;
+                }
+            } else if (mergeFetched(entry, fetched, plan.fetch)) {
+                std::lock_guard<std::mutex> lock(cacheMutex);
+                cache.store(batch.symbols[i], entry);
+            } else if (plan.fetch.first <= batch.ranges[i].first) {
+                entry.series = std::move(fetched);
+                entry.coverage = plan.fetch;
+                std::lock_guard<std::mutex> lock(cacheMutex);
+                cache.store(batch.symbols[i], entry);
+            } else {
+                // Cached bars are stale; fetch the whole range again
+                metrics().add(Metrics::RETRIES);
+                retries->push_back(FetchPlan{i, DateRange{batch.ranges[i].first, plan.fetch.last}});
+                entry = CachedSeries();
+                return;
+            }
+            
+            PriceSeries series = sliceSeries(entry.series, batch.ranges[i]);
+            entry = CachedSeries();
+            batch.onComplete(i, series);
+        }, [this, served, retries, retryRound](std::exception_ptr error) {
+            if (!error && !retryRound && !retries->empty()) {
+                try {
+                    runFetches(served, *retries, true);
+                    return;
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+            finishBatch(served->batch, error);
+        });
+    }
+    
+    static void finishBatch(const AsyncBatch& batch, std::exception_ptr error) {
+        if (batch.onDone) batch.onDone(error);
+    }
+    
+    static DateRange parseRange(const std::string& startDate, const std::string& endDate) {
+        DateRange range = DateRange::all();
+        if (!startDate.empty() && !parseDate(startDate, range.first)) {
+            std::cerr << "Invalid start date: " << startDate << std::endl;
+        }
+        if (!endDate.empty() && !parseDate(endDate, range.last)) {
+            std::cerr << "Invalid end date: " << endDate << std::endl;
+        }
+        return range;
+    }
+    
+    // Serve what the cache covers at once and start fetching the rest; the
+    // engine finishes the batch. Runs on the fetch loop thread.
+    void startServing(AsyncBatch batch) {
+        if (!provider->cacheable()) {
+            std::function<void(size_t, PriceSeries&)> onComplete = batch.onComplete;
+            provider->startBatch(batch.symbols, batch.ranges, [onComplete](size_t i, bool, PriceSeries& series) {
+                onComplete(i, series);
+            }, batch.onDone);
+            return;
+        }
+        
+        int today = currentDay();
+        std::shared_ptr<ServedBatch> served(new ServedBatch{std::move(batch), std::vector<CachedSeries>()});
+        const std::vector<std::string>& symbols = served->batch.symbols;
+        std::vector<CachedSeries>& cached = served->cached;
+        cached.resize(symbols.size());
+        std::vector<FetchPlan> plans;
+        
+        for (size_t i = 0; i < symbols.size(); i++) {
+            const DateRange& range = served->batch.ranges[i];
+            CachedSeries& entry = cached[i];
+            bool found;
+            {
+                std::lock_guard<std::mutex> lock(cacheMutex);
+                found = cache.load(symbols[i], entry);
+            }
+            
+            if (found && covers(entry, range, today)) {
+                metrics().add(Metrics::CACHE_HITS);
+                PriceSeries series = sliceSeries(entry.series, range);
+                entry = CachedSeries();
+                served->batch.onComplete(i, series);
+                continue;
+            }
+            
+            // Continue from the last cached bar when only the tail is missing
+            DateRange fetch = DateRange{range.first, std::min(range.last, today)};
+            if (found && !entry.series.empty() && entry.coverage.contains(range.first)) {
+                fetch.first = std::max(range.first, entry.series.lastDate());
+            } else {
+                entry = CachedSeries();
+            }
+            plans.push_back(FetchPlan{i, fetch});
+        }
+        
+        runFetches(served, plans, false);
+    }
+    
+    // Fetch loop thread: start each batch as it is queued, with its
+    // transfers joining those already in flight on the engine's connections
+    // and rate limit, and drive the engine until nothing is queued or in
+    // flight. Each batch is done once its own symbols are. A batch that
+    // fails, from its callback or otherwise, hands the exception to its
+    // caller and leaves the loop running. Queued batches are finished
+    // before the thread stops.
+    void asyncLoop() {
+        std::unique_lock<std::mutex> lock(asyncMutex);
+        while (true) {
+            if (asyncQueue.empty() && !engine.busy()) {
+                if (asyncStopping) return;
+                asyncReady.wait(lock, [this]() { return asyncStopping || !asyncQueue.empty(); });
+                continue;
+            }
+            std::vector<AsyncBatch> batches;
+            batches.swap(asyncQueue);
+            lock.unlock();
+            
+            for (AsyncBatch& batch : batches) {
+                FetchEngine::FinishHandler onDone = batch.onDone;
+                try {
+                    startServing(std::move(batch));
+                } catch (...) {
+                    // Nothing of the batch is left with the engine once startServing has thrown
+                    if (onDone) onDone(std::current_exception());
+                }
+            }
+            if (engine.busy()) engine.step(FETCH_LOOP_WAIT_MS);
+            lock.lock();
+        }
+    }
+    
+    // Hand a batch to the fetch loop, starting it on first use
+    void enqueue(AsyncBatch batch) {
+        {
+            std::lock_guard<std::mutex> lock(asyncMutex);
+            asyncQueue.push_back(std::move(batch));
+            if (!asyncThread.joinable()) asyncThread = std::thread(&MarketData::asyncLoop, this);
+        }
+        asyncReady.notify_one();
+        engine.wake();
+    }
+    
+public:
+    // Defaults match the previous one-request-per-second pacing
+    static constexpr int DEFAULT_MAX_CONCURRENT = 8;
+    static constexpr double DEFAULT_REQUESTS_PER_MINUTE = 60.0;
+    static constexpr double DEFAULT_BURST = 1.0;
+    static constexpr const char* DEFAULT_CACHE_DIRECTORY = "price_cache";
+    // Longest the fetch loop sleeps between checks, when it has no wakeup pipe
+    static constexpr long FETCH_LOOP_WAIT_MS = 100;
+    
+    // An empty cache directory opens no cache at all
+    MarketData(const std::string& key, const std::string& cacheDir = DEFAULT_CACHE_DIRECTORY)
+        : apiKey(key), engine(handles, DEFAULT_MAX_CONCURRENT, DEFAULT_REQUESTS_PER_MINUTE, DEFAULT_BURST),
+          cache(cacheDir), provider(new AlphaVantageProvider(engine, key)), asyncStopping(false) {}
+    
+    // Finish the queued asynchronous batches and stop the fetch loop
+    ~MarketData() {
+        {
+            std::lock_guard<std::mutex> lock(asyncMutex);
+            asyncStopping = true;
+        }
+        asyncReady.notify_one();
+        engine.wake();
+        if (asyncThread.joinable()) asyncThread.join();
+    }
+    
+    // Set the API key sent with every request
+    void setApiKey(const std::string& key) {
+        apiKey = key;
+        provider->setApiKey(key);
+    }
+    
+    // Choose where prices come from: "alphavantage", "local:DIR" for a
+    // snapshot directory, or "bulk:URL" for a multi-symbol endpoint, with
+    // a URL template as described for BulkProvider. False for anything else.
+    bool setProvider(const std::string& spec) {
+        if (!isProviderSpec(spec)) return false;
+        if (spec == "alphavantage") provider.reset(new AlphaVantageProvider(engine, apiKey));
+        else if (spec[0] == 'l') provider.reset(new LocalDirectoryProvider(spec.substr(6)));
+        else provider.reset(new BulkProvider(engine, spec.substr(5), apiKey));
+        return true;
+    }
+    
+    static bool isProviderSpec(const std::string& spec) {
+        return spec == "alphavantage" || (spec.compare(0, 6, "local:") == 0 && spec.size() > 6) ||
+               (spec.compare(0, 5, "bulk:") == 0 && spec.size() > 5);
+    }
+    
+    const MarketDataProvider& getProvider() const {
+        return *provider;
+    }
+    
+    // Set the number of requests kept in flight at once
+    void setMaxConcurrentRequests(int maxConcurrent) {
+        engine.setMaxConcurrent(maxConcurrent);
+    }
+    
+    // Set how many times a failed request is retried
+    void setMaxRetries(int retries) {
+        engine.setMaxAttempts(retries + 1);
+    }
+    
+    // Negotiate HTTP/2 with the API host when available
+    void setHttp2(bool enabled) {
+        handles.setHttp2(enabled);
+    }
+    
+    // Set the API plan's quota; burst is how many requests may go out back to back
+    void setRateLimit(double requestsPerMinute, double burst = DEFAULT_BURST) {
+        engine.setRateLimit(requestsPerMinute, burst);
+    }
+    
+    // Set where fetched prices are cached; empty disables the cache
+    void setCacheDirectory(const std::string& dir) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        cache.setDirectory(dir);
+    }
+    
+    // Write newly fetched prices into the mapped price store
+    void flushCache() {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        cache.flush();
+    }
+    
+    // Fetch historical data for a symbol and date range (YYYY-MM-DD, empty
+    // for no bound)
+    PriceSeries fetchHistoricalData(const std::string& symbol, const std::string& startDate, const std::string& endDate) {
+        PriceSeries result;
+        fetchHistoricalDataBatch(std::vector<std::string>(1, symbol), std::vector<DateRange>(1, parseRange(startDate, endDate)),
+                                 [&](size_t, PriceSeries& series) {
+            result = std::move(series);
+        });
+        return result;
+    }
+    
+    // Fetch historical data for many symbols concurrently, within the rate limit,
+    // returning only the bars inside each symbol's date range. Requests the cache
+    // already covers are served without a request; otherwise only the missing
+    // part is asked of the provider. Providers that read local files bypass
+    // the cache. onComplete receives the symbol's index and its series as each
+    // one becomes available, on the fetch loop's thread; an exception it
+    // throws ends the batch and is rethrown here. Waits on the fetch loop,
+    // so it must not be called from a fetch callback.
+    void fetchHistoricalDataBatch(const std::vector<std::string>& symbols, const std::vector<DateRange>& ranges,
+                                  const std::function<void(size_t, PriceSeries&)>& onComplete) {
+        fetchHistoricalDataBatchAsync(symbols, ranges, onComplete).get();
+    }
+    
+    // Queue a batch like fetchHistoricalDataBatch and return at once.
+    // onComplete runs on the fetch loop's thread as each series arrives,
+    // and must not fetch synchronously itself; the future is ready once the
+    // batch's own symbols are through, and holds the exception if it failed.
+    // Batches queued while others are running join them in flight, so any
+    // number of callers share one thread and one set of connections, and a
+    // small batch isn't held up behind a large one.
+    std::future<void> fetchHistoricalDataBatchAsync(const std::vector<std::string>& symbols, const std::vector<DateRange>& ranges,
+                                                    const std::function<void(size_t, PriceSeries&)>& onComplete) {
+        std::shared_ptr<std::promise<void>> done = std::make_shared<std::promise<void>>();
+        std::future<void> ready = done->get_future();
+        enqueue(AsyncBatch{symbols, ranges, onComplete, [done](std::exception_ptr error) {
+            if (error) done->set_exception(error);
+            else done->set_value();
+        }});
+        return ready;
+    }
+    
+    // Fetch one symbol in the background; the future holds its series,
+    // empty if it couldn't be had
+    std::future<PriceSeries> fetchHistoricalDataAsync(const std::string& symbol, const std::string& startDate,
+                                                      const std::string& endDate) {
+        std::shared_ptr<PriceSeries> result = std::make_shared<PriceSeries>();
+        std::shared_ptr<std::promise<PriceSeries>> done = std::make_shared<std::promise<PriceSeries>>();
+        std::future<PriceSeries> ready = done->get_future();
+        enqueue(AsyncBatch{std::vector<std::string>(1, symbol), std::vector<DateRange>(1, parseRange(startDate, endDate)),
+                           [result](size_t, PriceSeries& series) { *result = std::move(series); },
+                           [result, done](std::exception_ptr error) {
+            if (error) done->set_exception(error);
+            else done->set_value(std::move(*result));
+        }});
+        return ready;
+    }
+    
+    // Calculate market returns (SPY)
+    std::vector<double> calculateMarketReturns(const std::vector<double>& marketPrices) {
+        std::vector<double> returns(marketPrices.empty() ? 0 : marketPrices.size() - 1);
+        kernels().simpleReturns(marketPrices.data(), returns.size(), returns.data());
+        return returns;
+    }
+};
+
+// Bounded lock-free multi-producer, multi-consumer queue (Vyukov). Each slot
+// carries a sequence number saying whether it is ready to be filled or read
+// for a given lap, so push and pop each claim a slot with one compare-and-swap
+// on a shared index and never take a lock. Capacity rounds up to a power of two.
+template <typename T>
+class BoundedQueue {
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head; // Next position to push
+    alignas(64) std::atomic<size_t> tail; // Next position to pop
+    std::atomic<bool> closed;
+    
+    // Wait a little longer on each failed attempt: yield, then short sleeps
+    static void backOff(int attempt) {
+        if (attempt < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50 << std::min(attempt - 64, 4)));
+        }
+    }
+    
+public:
+    explicit BoundedQueue(size_t capacity) : mask(0), head(0), tail(0), closed(false) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    
+    // Move value in unless the queue is full
+    bool tryPush(T& value) {
+        size_t position = head.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots[position & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    // Move the oldest value out unless the queue is empty
+    bool tryPop(T& value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots[position & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(slot.value);
+                    slot.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    // Push, waiting for room
+    void push(T& value) {
+        for (int attempt = 0; !tryPush(value); attempt++) backOff(attempt);
+    }
+    
+    // Pop, waiting for a value; false once the queue is closed and drained
+    bool pop(T& value) {
+        for (int attempt = 0;; attempt++) {
+            if (tryPop(value)) return true;
+            if (closed.load(std::memory_order_acquire)) return tryPop(value);
+            backOff(attempt);
+        }
+    }
+    
+    // Tell consumers no more values are coming
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+};
+
+// StockAnalyzer class to handle the analysis process
+class StockAnalyzer {
+private:
+    MarketData marketData;
+    EventStore events; // Earnings events; declared ahead of the groups that point into it
+    SurpriseClassifier classifier;
+    std::vector<Group> groups; // Indexed by classifier group id
+    TradingCalendar calendar;
+    std::vector<double> marketPrices;
+    std::vector<double> marketReturns;
+    int eventWindow; // Trading days either side of the earnings date
+    unsigned bootstrapThreads; // 0 uses every hardware thread
+    uint64_t bootstrapSeed; // 0 draws a fresh seed for each run
+    std::vector<EventHandle> bySurprise; // Grouped events in surprise order
+    size_t streamChunkEvents; // Events fetched and folded per chunk when streaming, 0 for no streaming
+    size_t streamRowCapacity; // Rows each group keeps for bootstrapping when streaming
+    std::string streamedReturnsOutput; // Where streamed chunks' abnormal returns go, empty for nowhere
+    ExportFormat exportFormat;
+    int exportPrecision; // Significant digits of CSV numbers, 0 for the shortest exact form
+    uint32_t shardIndex; // Shard of the symbols this run loads
+    uint32_t shardCount; // 1 loads every symbol
+    std::vector<bool> mergedShards; // Shards whose partial results were merged, by index
+    ReturnModel returnModel;
+    int estimationFirst; // Market model estimation window: days -estimationFirst
+    int estimationLast;  // to -estimationLast before the earnings date
+    
+    // Last bootstrap's results per group and day, as exported; emptied
+    // whenever a group changes
+    struct BootstrapDay {
+        uint64_t iterations; // 0 when the group had no CAAR that day
+        double mean;
+        double standardError;
+        double lower95;
+        double upper95;
+    };
+    std::vector<std::vector<BootstrapDay>> bootstrapSummary;
+    uint64_t bootstrapRun[3]; // Sample size, iterations and seed of that bootstrap
+    
+    // Snapshot file: a SnapshotHeader, then snapshot arrays in the order
+    // writeSnapshot writes them. Little-endian, packed as laid out.
+    static constexpr char SNAPSHOT_MAGIC[9] = "SASNAPSH";
+    static constexpr uint32_t SNAPSHOT_VERSION = 1;
+    
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t window;
+        uint32_t returnModel;
+        uint32_t estimationFirst;
+        uint32_t estimationLast;
+        uint32_t groupCount;
+        uint64_t streamChunkEvents;
+        uint64_t streamRowCapacity;
+    };
+    
+    // Partial results file: a header, the classifier's cuts, then for each
+    // group a PartialGroup record, its per-day sums and its rows, each row
+    // a PartialRow followed by its abnormal returns. Little-endian, packed
+    // as the structs are laid out.
+    static constexpr char PARTIAL_MAGIC[9] = "SAPARTIA";
+    static constexpr uint32_t PARTIAL_VERSION = 2;
+    static constexpr size_t PARTIAL_NAME_SIZE = 16;
+    
+    struct PartialHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t window;
+        uint32_t shardIndex;
+        uint32_t shardCount;
+        uint32_t cutCount;
+        uint32_t groupCount;
+        uint32_t returnModel;
+        uint32_t estimationFirst;
+        uint32_t estimationLast;
+    };
+    
+    struct PartialCut {
+        double value;
+        uint32_t inclusive;
+        uint32_t reserved;
+    };
+    
+    struct PartialGroup {
+        char name[PARTIAL_NAME_SIZE];
+        uint64_t eventCount;
+        uint32_t windowDays;
+        uint32_t rowCount;
+    };
+    
+    struct PartialRow {
+        char symbol[PARTIAL_NAME_SIZE];
+        double epsEstimate;
+        double actualEPS;
+        int32_t earningsDay;
+        int32_t reserved;
+    };
+    
+    // Group an event belongs in under the current classifier
+    Group& classify(EventHandle h) {
+        return groups[classifier.classify(events.surprises[h])];
+    }
+    
+    // Move a grouped event to the group its surprise now calls for
+    bool regroup(EventHandle h) {
+        Group& target = classify(h);
+        if (events.groupIds[h] == target.id) return false;
+        bootstrapSummary.clear();
+        groups[events.groupIds[h]].removeEvent(h);
+        target.addEvent(h);
+        return true;
+    }
+    
+    // Put an event with abnormal returns into its group. Streamed groups
+    // can't move events, so they skip the surprise index.
+    void addToGroup(EventHandle h) {
+        bootstrapSummary.clear();
+        if (!classify(h).addEvent(h) || streamChunkEvents > 0) return;
+        const std::vector<double>& surprises = events.surprises;
+        auto position = std::upper_bound(bySurprise.begin(), bySurprise.end(), h, [&](EventHandle a, EventHandle b) {
+            return surprises[a] < surprises[b];
+        });
+        bySurprise.insert(position, h);
+    }
+    
+    // Take an event out of its group
+    void removeFromGroup(EventHandle h) {
+        if (events.groupIds[h] == EventStore::NO_GROUP) return;
+        bootstrapSummary.clear();
+        groups[events.groupIds[h]].removeEvent(h);
+        auto position = std::find(bySurprise.begin(), bySurprise.end(), h);
+        if (position != bySurprise.end()) bySurprise.erase(position);
+    }
+    
+    // Whether some grouped events are known only by their group rows, having
+    // been streamed or merged from partial results, so they can't move
+    bool rowsOnly() const {
+        for (const Group& group : groups) {
+            if (group.sampled()) return true;
+            if (!group.events.empty() && events.windowOffsets[group.events.front()] == EventStore::NO_WINDOW) return true;
+        }
+        return false;
+    }
+    
+    // Whether any group holds an event
+    bool anyGrouped() const {
+        for (const Group& group : groups) {
+            if (group.eventCount > 0) return true;
+        }
+        return false;
+    }
+    
+    // Empty every group, so the next retrieval recomputes every stock
+    void resetGroups() {
+        for (Group& group : groups) group.clear();
+        bySurprise.clear();
+        bootstrapSummary.clear();
+    }
+    
+    // Columns of the abnormal returns table
+    static std::vector<TableWriter::Column> abnormalReturnColumns() {
+        return {{"Symbol", TableWriter::TEXT, 16}, {"Date", TableWriter::TEXT, 10}, {"Group", TableWriter::TEXT, 16},
+                {"Surprise", TableWriter::NUMBER, 0}, {"Day", TableWriter::INTEGER, 0},
+                {"AbnormalReturn", TableWriter::NUMBER, 0}};
+    }
+    
+    // Write the abnormal returns of the given events that have them
+    void writeAbnormalReturns(TableWriter& table, const std::vector<EventHandle>& handles) const {
+        for (EventHandle h : handles) {
+            if (events.groupIds[h] == EventStore::NO_GROUP || events.windowOffsets[h] == EventStore::NO_WINDOW) continue;
+            SeriesView abnormalReturns = events.abnormalReturns(h);
+            std::string date = formatDate(events.earningsDays[h]);
+            for (size_t day = 0; day < abnormalReturns.size(); day++) {
+                table.text(events.symbol(h));
+                table.text(date);
+                table.text(groups[events.groupIds[h]].name);
+                table.number(events.surprises[h]);
+                table.integer(static_cast<int>(day) - eventWindow);
+                table.number(abnormalReturns[day]);
+                table.endRow();
+            }
+        }
+    }
+    
+    // Whether the market model can be fitted over days -first to -last
+    static bool validEstimationWindow(ReturnModel model, int first, int last) {
+        return model != MARKET_MODEL || (last >= 1 && first >= last);
+    }
+    
+    // Replace the groups with empty ones named by the classifier
+    void buildGroups() {
+        resetGroups();
+        groups.clear();
+        size_t maxRows = streamChunkEvents > 0 ? streamRowCapacity : 0;
+        for (const std::string& name : classifier.names) {
+            groups.emplace_back(name, &events, static_cast<int32_t>(groups.size()), maxRows);
+        }
+    }
+    
+public:
+    static constexpr int DEFAULT_EVENT_WINDOW = 30;
+    static constexpr int BOOTSTRAP_BLOCK_ITERATIONS = 1024;
+    static constexpr size_t PIPELINE_QUEUE_CAPACITY = 64; // Fetched series awaiting compute
+    static constexpr size_t DEFAULT_STREAM_ROWS = 10000;
+    static constexpr int DEFAULT_ESTIMATION_FIRST = 250;
+    static constexpr int DEFAULT_ESTIMATION_LAST = 31;
+    
+    StockAnalyzer(const std::string& apiKey, const std::string& cacheDir = MarketData::DEFAULT_CACHE_DIRECTORY)
+        : marketData(apiKey, cacheDir), events(DEFAULT_EVENT_WINDOW), classifier(SurpriseClassifier::beatMeetMiss(5.0, -5.0)),
+          eventWindow(DEFAULT_EVENT_WINDOW), bootstrapThreads(0), bootstrapSeed(0), streamChunkEvents(0),
+          streamRowCapacity(DEFAULT_STREAM_ROWS), exportFormat(EXPORT_CSV), exportPrecision(6), shardIndex(0),
+          shardCount(1), returnModel(MARKET_ADJUSTED), estimationFirst(DEFAULT_ESTIMATION_FIRST),
+          estimationLast(DEFAULT_ESTIMATION_LAST), bootstrapRun{0, 0, 0} {
+        buildGroups();
+    }
+    
+    // Forget every event and group member, keeping the settings
+    void clearEvents() {
+        resetGroups();
+        int lookback = events.lookback;
+        events = EventStore(eventWindow);
+        events.setLookback(lookback);
+        mergedShards.clear();
+    }
+    
+    // Market data source, for its connection, rate and cache settings
+    MarketData& getMarketData() {
+        return marketData;
+    }
+    
+    // Set how many threads bootstrapping uses; 0 uses every hardware thread
+    void setBootstrapThreads(unsigned threads) {
+        bootstrapThreads = threads;
+    }
+    
+    // Fix the bootstrap seed so runs can be reproduced; 0 draws a fresh seed
+    void setBootstrapSeed(uint64_t seed) {
+        bootstrapSeed = seed;
+    }
+    
+    // Stream the analysis in chunks of about chunkEvents events: each chunk
+    // is fetched, folded into the group sums and its prices dropped before
+    // the next, and each group keeps a uniform sample of rowsPerGroup rows
+    // for bootstrapping. Peak memory then follows the chunk size and the
+    // sample, not the number of events. Groups are emptied, and then can't
+    // give events back, so a new classifier means retrieving again.
+    // chunkEvents 0 keeps everything in memory.
+    void setStreaming(size_t chunkEvents, size_t rowsPerGroup = DEFAULT_STREAM_ROWS) {
+        streamChunkEvents = chunkEvents;
+        streamRowCapacity = std::max<size_t>(1, rowsPerGroup);
+        buildGroups();
+    }
+    
+    // Set how many trading days either side of the earnings date are analyzed.
+    // Changing it empties the groups and the price arena, since every row
+    // changes length.
+    void setEventWindow(int tradingDays) {
+        tradingDays = std::max(1, tradingDays);
+        if (tradingDays != eventWindow) {
+            resetGroups();
+            events.clearWindows(tradingDays);
+        }
+        eventWindow = tradingDays;
+    }
+    
+    // Choose how abnormal returns are measured. The market model fits
+    // alpha and beta by OLS over days -first to -last before each earnings
+    // date and subtracts alpha plus beta times the market's return; events
+    // with fewer than half those days known are left out. Changing the model
+    // empties the groups and the price arena, like a new window.
+    bool setReturnModel(ReturnModel model, int first = DEFAULT_ESTIMATION_FIRST, int last = DEFAULT_ESTIMATION_LAST) {
+        if (!validEstimationWindow(model, first, last)) {
+            std::cerr << "The estimation window must run from day -" << first << " to a later day -" << last
+                      << ", at least a day before the earnings date." << std::endl;
+            return false;
+        }
+        if (model == MARKET_ADJUSTED) {
+            first = DEFAULT_ESTIMATION_FIRST;
+            last = DEFAULT_ESTIMATION_LAST;
+        }
+        if (model != returnModel || first != estimationFirst || last != estimationLast) {
+            resetGroups();
+            events.clearWindows(eventWindow);
+        }
+        returnModel = model;
+        estimationFirst = first;
+        estimationLast = last;
+        events.setLookback(model == MARKET_MODEL ? first : 0);
+        return true;
+    }
+    
+    // Switch to a new classifier. With the same groups, only stocks whose
+    // surprise lies between a cut's old and new values can change group, so
+    // just those are looked at; otherwise the groups are rebuilt from the
+    // stocks' abnormal returns, without fetching anything.
+    void setClassifier(const SurpriseClassifier& next) {
+        if (rowsOnly()) {
+            classifier = next;
+            buildGroups();
+            std::cout << groups.size() << " groups; retrieve the data again to regroup the streamed or merged events.\n";
+            return;
+        }
+        
+        size_t moved = 0;
+        if (next.names == classifier.names) {
+            // Stocks between each old cut and its new value
+            std::vector<EventHandle> crossing;
+            const std::vector<double>& surprises = events.surprises;
+            auto surpriseBelow = [&](double value, EventHandle h) { return value < surprises[h]; };
+            auto surpriseAbove = [&](EventHandle h, double value) { return surprises[h] < value; };
+            for (size_t i = 0; i < next.cuts.size(); i++) {
+                double from = classifier.cuts[i].value, to = next.cuts[i].value;
+                auto first = std::lower_bound(bySurprise.begin(), bySurprise.end(), std::min(from, to), surpriseAbove);
+                auto last = std::upper_bound(first, bySurprise.end(), std::max(from, to), surpriseBelow);
+                crossing.insert(crossing.end(), first, last);
+            }
+            
+            classifier = next;
+            for (EventHandle h : crossing) {
+                if (regroup(h)) moved++;
+            }
+        } else {
+            std::vector<EventHandle> grouped = bySurprise;
+            classifier = next;
+            buildGroups();
+            for (EventHandle h : grouped) addToGroup(h);
+            moved = grouped.size();
+        }
+        if (!bySurprise.empty()) {
+            std::cout << groups.size() << " groups; " << moved << " event(s) moved.\n";
+        }
+    }
+    
+    // Group by Beat/Meet/Miss with the given surprise thresholds, in percent
+    bool setSurpriseThresholds(double beatAbove, double missBelow) {
+        if (!(missBelow <= beatAbove)) {
+            std::cerr << "The miss threshold must not be above the beat threshold." << std::endl;
+            return false;
+        }
+        setClassifier(SurpriseClassifier::beatMeetMiss(beatAbove, missBelow));
+        return true;
+    }
+    
+    // Group into quantiles of surprise, over the stocks with abnormal
+    // returns, or over every loaded stock before any are retrieved
+    bool setQuantileGroups(size_t count) {
+        if (count < 2) {
+            std::cerr << "Quantile grouping needs at least 2 groups." << std::endl;
+            return false;
+        }
+        std::vector<double> surprises;
+        for (EventHandle h : bySurprise) surprises.push_back(events.surprises[h]);
+        if (surprises.empty()) {
+            for (EventHandle h : events.ordered()) surprises.push_back(events.surprises[h]);
+        }
+        setClassifier(SurpriseClassifier::fromQuantiles(std::move(surprises), count));
+        return true;
+    }
+    
+    // Group names, comma separated, highest surprise first
+    std::string groupList() const {
+        std::string list;
+        for (const Group& group : groups) {
+            if (!list.empty()) list += ", ";
+            list += group.name;
+        }
+        return list;
+    }
+    
+    // Group with the given name, if any
+    Group* findGroup(const std::string& name) {
+        for (Group& group : groups) {
+            if (group.name == name) return &group;
+        }
+        return nullptr;
+    }
+    
+    // Add an event whose window is an already computed segment, starting at
+    // the window's first bar, and group it. The caller keeps (symbol, date)
+    // pairs unique. False if the segment doesn't hold the window.
+    bool addAnalyzedEvent(std::string_view symbol, double epsEstimate, double actual, int earningsDay,
+                          const PriceSegment& segment) {
+        EventHandle h = events.add(symbol, epsEstimate, actual, earningsDay);
+        if (!events.attach(h, events.appendSegment(segment), segment.calendarStart)) return false;
+        addToGroup(h);
+        return true;
+    }
+    
+    // Drop every event of a symbol from its group and from the analysis
+    bool removeStock(const std::string& symbol) {
+        std::vector<EventHandle> found = events.eventsOf(symbol);
+        for (EventHandle h : found) {
+            removeFromGroup(h);
+            events.remove(h);
+        }
+        return !found.empty();
+    }
+    
+    // Number of distinct symbols among the loaded events
+    size_t symbolCount() {
+        size_t count = 0;
+        uint32_t previous = 0;
+        for (EventHandle h : events.ordered()) {
+            if (count == 0 || events.symbols[h] != previous) count++;
+            previous = events.symbols[h];
+        }
+        return count;
+    }
+    
+    // Load stock data from a file; false if it can't be read or holds no valid rows
+    bool loadStockDataFromFile(const std::string& filename) {
+        ScopedTimer timer(Metrics::LOAD);
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file: " << filename << std::endl;
+            return false;
+        }
+        std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+        
+        std::string_view data(contents);
+        std::string_view line;
+        ParseReport report;
+        EventHandle first = static_cast<EventHandle>(events.size());
+        std::vector<uint32_t> rows; // Input row of each event added
+        size_t otherShards = 0; // Rows left to the other shards
+        
+        // Skip header
+        nextLine(data, line);
+        
+        for (size_t row = 2; nextLine(data, line); row++) {
+            if (line.empty()) continue;
+            
+            std::string_view symbol = trimField(nextField(line));
+            double epsEstimate, actualEPS;
+            
+            if (symbol.empty()) {
+                report.addError(row, 1, "missing symbol");
+                continue;
+            }
+            if (shardCount > 1 && shardOf(symbol, shardCount) != shardIndex) {
+                otherShards++;
+                continue;
+            }
+            if (!parseNumber(nextField(line), epsEstimate)) {
+                report.addError(row, 2, "invalid EPS estimate");
+                continue;
+            }
+            if (!parseNumber(nextField(line), actualEPS)) {
+                report.addError(row, 3, "invalid actual EPS");
+                continue;
+            }
+            std::string_view date = trimField(line);
+            int day;
+            if (!parseDate(date, day)) {
+                report.addError(row, 4, "invalid earnings date");
+                continue;
+            }
+            
+            events.add(symbol, epsEstimate, actualEPS, day);
+            rows.push_back(static_cast<uint32_t>(row));
+            report.rowsParsed++;
+        }
+        
+        // A symbol can have any number of events, one per earnings date
+        std::vector<uint32_t> duplicateRows;
+        for (EventHandle h : events.removeDuplicates(first)) duplicateRows.push_back(rows[h - first]);
+        std::sort(duplicateRows.begin(), duplicateRows.end());
+        for (uint32_t row : duplicateRows) report.addError(row, 4, "duplicate earnings event");
+        report.rowsParsed -= duplicateRows.size();
+        
+        report.print(filename);
+        if (otherShards > 0) {
+            std::cout << "Shard " << shardIndex << "/" << shardCount << ": " << otherShards
+                      << " row(s) left to the other shards.\n";
+        }
+        return report.rowsParsed > 0 || otherShards > 0;
+    }
+    
+    // Fetch prices and compute abnormal returns for the events not yet
+    // grouped. False if the market data can't be had or no event ends up in
+    // a group.
+    bool retrieveHistoricalData() {
+        // Events already grouped keep their abnormal returns, so only new
+        // events, and ones that lacked price data last time, are fetched.
+        // Each symbol is fetched once, over the span of its pending events.
+        // Symbol i's events, earliest first, are pending[symbolStarts[i]] up
+        // to pending[symbolStarts[i + 1]].
+        std::vector<EventHandle> pending;
+        std::vector<size_t> symbolStarts;
+        std::vector<std::string> symbols;
+        std::vector<DateRange> ranges;
+        DateRange marketRange = DateRange{std::numeric_limits<int>::max(), std::numeric_limits<int>::min()};
+        for (EventHandle h : events.ordered()) {
+            if (events.groupIds[h] != EventStore::NO_GROUP) continue;
+            DateRange range = events.eventRange(h);
+            if (symbols.empty() || symbols.back() != events.symbol(h)) {
+                symbolStarts.push_back(pending.size());
+                symbols.push_back(events.symbol(h));
+                ranges.push_back(range);
+            }
+            pending.push_back(h);
+            ranges.back().first = std::min(ranges.back().first, range.first);
+            ranges.back().last = std::max(ranges.back().last, range.last);
+            marketRange.first = std::min(marketRange.first, range.first);
+            marketRange.last = std::max(marketRange.last, range.last);
+        }
+        if (pending.empty()) {
+            std::cout << "Every event already has its abnormal returns.\n";
+            return anyGrouped();
+        }
+        symbolStarts.push_back(pending.size());
+        
+        // First, retrieve market data (SPY) spanning every new event window
+        std::cout << "Retrieving market data (SPY)...\n";
+        PriceSeries marketSeries;
+        {
+            ScopedTimer timer(Metrics::FETCH_MARKET);
+            marketSeries = marketData.fetchHistoricalData("SPY", formatDate(marketRange.first), formatDate(marketRange.last));
+        }
+        if (marketSeries.empty()) {
+            std::cerr << "No market data for SPY; stock returns can't be adjusted." << std::endl;
+            return false;
+        }
+        calendar.build(marketSeries.dates);
+        marketPrices = std::move(marketSeries.prices);
+        marketReturns = marketData.calculateMarketReturns(marketPrices);
+        
+        // Then the stocks, all at once or, when streaming, a chunk of
+        // symbols at a time, dropping each chunk's prices once it is grouped
+        std::vector<EventHandle> insufficient;
+        if (streamChunkEvents == 0) {
+            fetchAndGroup(pending, symbolStarts, symbols, ranges, 0, symbols.size(), insufficient);
+        } else {
+            TableWriter streamed(exportFormat, exportPrecision);
+            bool writing = !streamedReturnsOutput.empty();
+            if (writing && !streamed.open(streamedReturnsOutput, abnormalReturnColumns())) return false;
+            size_t chunks = 0;
+            for (size_t first = 0; first < symbols.size(); chunks++) {
+                size_t last = first + 1;
+                while (last < symbols.size() && symbolStarts[last + 1] - symbolStarts[first] <= streamChunkEvents) last++;
+                
+                std::vector<EventHandle> chunkPending(pending.begin() + symbolStarts[first], pending.begin() + symbolStarts[last]);
+                std::vector<size_t> chunkStarts;
+                for (size_t i = first; i <= last; i++) chunkStarts.push_back(symbolStarts[i] - symbolStarts[first]);
+                std::vector<std::string> chunkSymbols(symbols.begin() + first, symbols.begin() + last);
+                std::vector<DateRange> chunkRanges(ranges.begin() + first, ranges.begin() + last);
+                fetchAndGroup(chunkPending, chunkStarts, chunkSymbols, chunkRanges, first, symbols.size(), insufficient);
+                if (writing) {
+                    ScopedTimer timer(Metrics::EXPORT);
+                    writeAbnormalReturns(streamed, chunkPending);
+                }
+                events.clearWindows(eventWindow);
+                first = last;
+            }
+            std::cout << "Streamed " << pending.size() << " events in " << chunks << " chunk(s).\n";
+            if (writing && streamed.close()) {
+                std::cout << "Abnormal returns exported to " << streamedReturnsOutput << std::endl;
+            }
+        }
+        metrics().add(Metrics::STOCKS_ANALYZED, pending.size() - insufficient.size());
+        metrics().add(Metrics::STOCKS_SKIPPED, insufficient.size());
+        
+        for (EventHandle h : insufficient) {
+            std::cerr << "Insufficient price history around " << formatDate(events.earningsDays[h]) << " for "
+                      << events.symbol(h) << std::endl;
+        }
+        size_t skipped = insufficient.size();
+        if (skipped > 0) {
+            std::cout << skipped << " event(s) left out for lack of price data around the earnings date.\n";
+        }
+        
+        {
+            ScopedTimer timer(Metrics::CACHE_FLUSH);
+            marketData.flushCache();
+        }
+        return anyGrouped();
+    }
+    
+    // Fetch the given symbols concurrently and group their pending events.
+    // Symbol i's events, earliest first, are pending[symbolStarts[i]] up to
+    // pending[symbolStarts[i + 1]]. Events without enough prices go to
+    // insufficient. Progress counts from firstSymbol of totalSymbols.
+    void fetchAndGroup(const std::vector<EventHandle>& pending, const std::vector<size_t>& symbolStarts,
+                       const std::vector<std::string>& symbols, const std::vector<DateRange>& ranges,
+                       size_t firstSymbol, size_t totalSymbols, std::vector<EventHandle>& insufficient) {
+        // The market data's fetch loop hands each parsed series to compute
+        // workers through a lock-free queue, so returns are computed while
+        // later downloads are in flight.
+        struct FetchedSeries {
+            size_t index;
+            PriceSeries series;
+        };
+        BoundedQueue<FetchedSeries> fetchedQueue(PIPELINE_QUEUE_CAPACITY);
+        
+        // Computed events join their groups in symbol and date order,
+        // whichever download lands first, so group contents don't depend on
+        // timing. Each addition updates its group's AAR and CAAR.
+        // Segments are copied into the event store's arena under the same
+        // lock; reserving room up front keeps those copies from reallocating.
+        std::mutex groupMutex;
+        std::vector<char> computed(symbols.size(), 0);
+        size_t nextToGroup = 0;
+        events.reserveArena(pending.size() * (2 * eventWindow + 2));
+        auto groupComputed = [&]() {
+            for (; nextToGroup < symbols.size() && computed[nextToGroup]; nextToGroup++) {
+                for (size_t k = symbolStarts[nextToGroup]; k < symbolStarts[nextToGroup + 1]; k++) {
+                    EventHandle h = pending[k];
+                    if (events.abnormalCounts[h] == 0) {
+                        insufficient.push_back(h);
+                    } else {
+                        addToGroup(h);
+                    }
+                }
+            }
+        };
+        
+        // Workers time only the symbols they compute, not their waits on the queue
+        auto computeWorker = [&]() {
+            FetchedSeries fetched;
+            std::vector<PriceSegment> segments;
+            std::vector<int> segmentOf;
+            uint64_t busyNanoseconds = 0, cpuNanoseconds = 0;
+            while (fetchedQueue.pop(fetched)) {
+                auto start = std::chrono::steady_clock::now();
+                uint64_t cpuStart = threadCpuNanoseconds();
+                const EventHandle* first = pending.data() + symbolStarts[fetched.index];
+                size_t count = symbolStarts[fetched.index + 1] - symbolStarts[fetched.index];
+                computeSegments(first, count, fetched.series, segments, segmentOf);
+                
+                {
+                    std::lock_guard<std::mutex> lock(groupMutex);
+                    attachSegments(first, count, segments, segmentOf);
+                    computed[fetched.index] = 1;
+                    groupComputed();
+                }
+                busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                cpuNanoseconds += threadCpuNanoseconds() - cpuStart;
+            }
+            metrics().record(Metrics::COMPUTE, busyNanoseconds, cpuNanoseconds);
+        };
+        
+        size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), symbols.size());
+        std::vector<std::thread> pool;
+        for (size_t w = 0; w < workers; w++) pool.emplace_back(computeWorker);
+        
+        {
+            ScopedTimer timer(Metrics::FETCH_STOCKS);
+            size_t count = firstSymbol;
+            std::future<void> done = marketData.fetchHistoricalDataBatchAsync(symbols, ranges, [&](size_t index, PriceSeries& series) {
+                std::cout << "Retrieved data for " << symbols[index] << " (" << ++count << "/" << totalSymbols << ")\n";
+                FetchedSeries fetched{index, std::move(series)};
+                fetchedQueue.push(fetched);
+            });
+            done.wait();
+            fetchedQueue.close();
+            for (std::thread& worker : pool) worker.join();
+            done.get(); // Rethrow a failed batch once the workers are done with it
+        }
+    }
+    
+    // Compute price segments for one symbol's events, earliest first, from
+    // its fetched series. Events whose windows overlap or touch share one
+    // segment, so each bar is aligned and each return computed once.
+    // segmentOf[k] is the segment holding event k's window, or -1 for events
+    // the calendar or the series can't cover.
+    // Under the market model the shared segments also span each event's
+    // estimation window, and are fitted from one set of prefix sums; since
+    // each event then has its own abnormal returns, each gets a segment of
+    // just its window.
+    void computeSegments(const EventHandle* handles, size_t count, const PriceSeries& series,
+                         std::vector<PriceSegment>& segments, std::vector<int>& segmentOf) const {
+        const int length = 2 * eventWindow + 2;
+        const bool marketModel = returnModel == MARKET_MODEL;
+        const size_t minimumDays = (estimationFirst - estimationLast + 2) / 2;
+        EstimationSums sums;
+        segments.clear();
+        segmentOf.assign(count, -1);
+        size_t first = 0;
+        while (first < count) {
+            int start = events.lookbackStart(handles[first], calendar);
+            if (start < 0) {
+                first++;
+                continue;
+            }
+            
+            // Extend the segment over every later window that overlaps or touches it
+            size_t last = first + 1;
+            int end = events.windowStart(handles[first], calendar) + length;
+            for (; last < count; last++) {
+                int next = events.lookbackStart(handles[last], calendar);
+                if (next < 0 || next > end) break;
+                end = std::max(end, events.windowStart(handles[last], calendar) + length);
+            }
+            
+            PriceSegment segment;
+            if (!segment.fill(series, calendar, start, end - start)) {
+                first = last;
+                continue;
+            }
+            segment.calculateReturns();
+            if (!marketModel) {
+                segment.calculateAbnormalReturns(marketReturns);
+                for (size_t k = first; k < last; k++) segmentOf[k] = static_cast<int>(segments.size());
+                segments.push_back(std::move(segment));
+                first = last;
+                continue;
+            }
+            
+            // Return j of the segment is the one on day j + 1 from its start,
+            // so day -d before an event at calendar index e is return e - d - 1
+            sums.build(segment, marketReturns);
+            for (size_t k = first; k < last; k++) {
+                int windowAt = events.windowStart(handles[k], calendar);
+                int event = windowAt + eventWindow + 1;
+                int from = std::max(0, event - estimationFirst - 1 - start);
+                int to = std::max(0, event - estimationLast - start);
+                double alpha, beta;
+                if (!sums.fit(from, to, minimumDays, alpha, beta)) continue;
+                
+                PriceSegment window;
+                int offset = windowAt - start;
+                window.calendarStart = windowAt;
+                window.prices.assign(segment.prices.begin() + offset, segment.prices.begin() + offset + length);
+                window.returns.assign(segment.returns.begin() + offset, segment.returns.begin() + offset + length - 1);
+                window.calculateAbnormalReturns(marketReturns, alpha, beta);
+                segmentOf[k] = static_cast<int>(segments.size());
+                segments.push_back(std::move(window));
+            }
+            first = last;
+        }
+    }
+    
+    // Copy computed segments into the arena and point their events at them
+    void attachSegments(const EventHandle* handles, size_t count, const std::vector<PriceSegment>& segments,
+                        const std::vector<int>& segmentOf) {
+        std::vector<SegmentRef> refs;
+        for (const PriceSegment& segment : segments) refs.push_back(events.appendSegment(segment));
+        for (size_t k = 0; k < count; k++) {
+            if (segmentOf[k] < 0 || !events.attach(handles[k], refs[segmentOf[k]], events.windowStart(handles[k], calendar))) {
+                events.detach(handles[k]);
+            }
+        }
+    }
+    
+    // Recalculate AAR and CAAR for all groups from their rows
+    void calculateGroupMetrics() {
+        for (Group& group : groups) {
+            group.rebuildSums();
+            group.calculateAAR();
+            group.calculateCAAR();
+        }
+    }
+    
+    // Get a symbol's events, earliest first
+    std::vector<EventHandle> getEvents(const std::string& symbol) {
+        return events.eventsOf(symbol);
+    }
+    
+    // Export CAAR per group, one column per group, for visualization
+    bool exportCAAR(const std::string& filename) {
+        ScopedTimer timer(Metrics::EXPORT);
+        std::vector<TableWriter::Column> columns = {{"Day", TableWriter::INTEGER, 0}};
+        size_t maxDays = 0;
+        for (const Group& group : groups) {
+            columns.push_back({group.name, TableWriter::NUMBER, 0});
+            maxDays = std::max(maxDays, group.caar.size());
+        }
+        TableWriter table(exportFormat, exportPrecision);
+        if (!table.open(filename, columns)) return false;
+        
+        for (size_t day = 0; day < maxDays; day++) {
+            table.integer(static_cast<int>(day) - eventWindow); // Day relative to earnings announcement
+            for (const Group& group : groups) {
+                if (day < group.caar.size()) table.number(group.caar[day]);
+                else table.missing();
+            }
+            table.endRow();
+        }
+        
+        if (!table.close()) return false;
+        std::cout << "CAAR data exported to " << filename << std::endl;
+        return true;
+    }
+    
+    // Export every grouped event's abnormal returns, one row per event and
+    // day. Streamed events are written while they are retrieved instead; see
+    // setStreamedReturnsOutput.
+    bool exportAbnormalReturns(const std::string& filename) {
+        if (streamChunkEvents > 0) {
+            std::cerr << "Streamed abnormal returns are dropped after grouping; set their output before retrieving." << std::endl;
+            return false;
+        }
+        ScopedTimer timer(Metrics::EXPORT);
+        TableWriter table(exportFormat, exportPrecision);
+        if (!table.open(filename, abnormalReturnColumns())) return false;
+        writeAbnormalReturns(table, events.ordered());
+        if (!table.close()) return false;
+        std::cout << "Abnormal returns exported to " << filename << std::endl;
+        return true;
+    }
+    
+    // Export a parameter sweep: AAR and CAAR of the Beat/Meet/Miss groups
+    // for every window of the given sizes (at most the event window) and
+    // every (beat, miss) pair of thresholds, one table row per combination,
+    // group and day. The events, in surprise order, fall into a handful of
+    // buckets between every distinct cut, and one pass over their abnormal
+    // returns sums each bucket's per-day returns; a group's sums are then a
+    // few bucket sums, and each window's CAAR is a difference of prefix sums
+    // of the widest window's AAR. Every combination covers the events whose
+    // widest window the prices cover.
+    bool exportSweep(const std::vector<int>& windows, const std::vector<std::pair<double, double>>& thresholds,
+                     const std::string& filename) const {
+        if (rowsOnly()) {
+            std::cerr << "A sweep needs every event's abnormal returns, which streamed or merged runs don't keep." << std::endl;
+            return false;
+        }
+        for (int window : windows) {
+            if (window < 1 || window > eventWindow) {
+                std::cerr << "Sweep window " << window << " is outside the retrieved window of " << eventWindow
+                          << " days." << std::endl;
+                return false;
+            }
+        }
+        ScopedTimer timer(Metrics::EXPORT);
+        const size_t days = 2 * eventWindow + 1;
+        std::vector<EventHandle> sorted;
+        for (EventHandle h : bySurprise) {
+            if (events.abnormalCounts[h] == days) sorted.push_back(h);
+        }
+        
+        // Each classifier's groups are runs of the surprise order, highest
+        // group last; bounds[c][g] is where group g starts
+        std::vector<SurpriseClassifier> classifiers;
+        std::vector<std::vector<size_t>> bounds;
+        std::vector<size_t> cuts = {0, sorted.size()};
+        for (const auto& pair : thresholds) {
+            classifiers.push_back(SurpriseClassifier::beatMeetMiss(pair.first, pair.second));
+            const SurpriseClassifier& classifier = classifiers.back();
+            std::vector<size_t> starts(classifier.groupCount());
+            for (size_t g = 0; g < classifier.groupCount(); g++) {
+                starts[g] = std::partition_point(sorted.begin(), sorted.end(), [&](EventHandle h) {
+                    return classifier.classify(events.surprises[h]) > g;
+                }) - sorted.begin();
+                cuts.push_back(starts[g]);
+            }
+            bounds.push_back(starts);
+        }
+        std::sort(cuts.begin(), cuts.end());
+        cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+        
+        // The one pass over the abnormal returns
+        std::vector<double> bucketSums((cuts.size() - 1) * days, 0.0);
+        for (size_t b = 0; b + 1 < cuts.size(); b++) {
+            for (size_t i = cuts[b]; i < cuts[b + 1]; i++) {
+                kernels().accumulate(bucketSums.data() + b * days, events.abnormalReturns(sorted[i]).data(), days);
+            }
+        }
+        
+        TableWriter table(exportFormat, exportPrecision);
+        if (!table.open(filename, {{"Window", TableWriter::INTEGER, 0}, {"BeatThreshold", TableWriter::NUMBER, 0},
+                                   {"MissThreshold", TableWriter::NUMBER, 0}, {"Group", TableWriter::TEXT, 16},
+                                   {"Events", TableWriter::INTEGER, 0}, {"Day", TableWriter::INTEGER, 0},
+                                   {"AAR", TableWriter::NUMBER, 0}, {"CAAR", TableWriter::NUMBER, 0}})) {
+            return false;
+        }
+        std::vector<double> aar(days), cumulative(days + 1);
+        for (size_t c = 0; c < classifiers.size(); c++) {
+            for (size_t g = 0; g < classifiers[c].groupCount(); g++) {
+                // Group g runs from the start of group g to that of group g - 1
+                size_t first = bounds[c][g], last = g > 0 ? bounds[c][g - 1] : sorted.size();
+                size_t count = last - first;
+                std::fill(aar.begin(), aar.end(), 0.0);
+                size_t b = std::lower_bound(cuts.begin(), cuts.end(), first) - cuts.begin();
+                for (; b + 1 < cuts.size() && cuts[b] < last; b++) {
+                    kernels().accumulate(aar.data(), bucketSums.data() + b * days, days);
+                }
+                double scale = count > 0 ? 1.0 / count : 0.0;
+                cumulative[0] = 0.0;
+                for (size_t day = 0; day < days; day++) {
+                    aar[day] *= scale;
+                    cumulative[day + 1] = cumulative[day] + aar[day];
+                }
+                
+                for (int window : windows) {
+                    size_t from = eventWindow - window; // Index of day -window
+                    for (int day = -window; day <= window; day++) {
+                        size_t index = eventWindow + day;
+                        table.integer(window);
+                        table.number(thresholds[c].first);
+                        table.number(thresholds[c].second);
+                        table.text(classifiers[c].names[g]);
+                        table.integer(static_cast<int32_t>(count));
+                        table.integer(day);
+                        if (count > 0) {
+                            table.number(aar[index]);
+                            table.number(cumulative[index + 1] - cumulative[from]);
+                        } else {
+                            table.missing();
+                            table.missing();
+                        }
+                        table.endRow();
+                    }
+                }
+            }
+        }
+        
+        if (!table.close()) return false;
+        std::cout << "Sweep of " << windows.size() << " window(s) x " << thresholds.size() << " threshold pair(s) over "
+                  << sorted.size() << " event(s) exported to " << filename << std::endl;
+        return true;
+    }
+    
+    // When streaming, write each chunk's abnormal returns to filename before
+    // its prices are dropped; empty to stop
+    void setStreamedReturnsOutput(const std::string& filename) {
+        streamedReturnsOutput = filename;
+    }
+    
+    // Choose the format of the exported tables, and the significant digits
+    // of CSV numbers (0 for the shortest form that reads back exactly)
+    void setExportFormat(ExportFormat format, int precision) {
+        exportFormat = format;
+        exportPrecision = std::max(0, precision);
+    }
+    
+    // Load only the symbols of shard index out of count, so several runs,
+    // each with its own API key, can split an input between them
+    void setShard(uint32_t index, uint32_t count) {
+        shardCount = std::max(1u, count);
+        shardIndex = std::min(index, shardCount - 1);
+    }
+    
+    // Shard a symbol falls in, by FNV-1a hash, the same on every machine
+    static uint32_t shardOf(std::string_view symbol, uint32_t count) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (char c : symbol) {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 0x100000001b3ULL;
+        }
+        return static_cast<uint32_t>(hash % count);
+    }
+    
+    // Write each group's event count, per-day sums and rows, for a reduce
+    // step to merge with the other shards' partial results
+    bool writePartial(const std::string& filename) const {
+        ScopedTimer timer(Metrics::EXPORT);
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file for writing: " << filename << std::endl;
+            return false;
+        }
+        PartialHeader header = {};
+        std::memcpy(header.magic, PARTIAL_MAGIC, 8);
+        header.version = PARTIAL_VERSION;
+        header.window = static_cast<uint32_t>(eventWindow);
+        header.shardIndex = shardIndex;
+        header.shardCount = shardCount;
+        header.cutCount = static_cast<uint32_t>(classifier.cuts.size());
+        header.groupCount = static_cast<uint32_t>(groups.size());
+        header.returnModel = static_cast<uint32_t>(returnModel);
+        header.estimationFirst = static_cast<uint32_t>(estimationFirst);
+        header.estimationLast = static_cast<uint32_t>(estimationLast);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const SurpriseClassifier::Cut& cut : classifier.cuts) {
+            PartialCut record = {cut.value, cut.inclusive ? 1u : 0u, 0};
+            file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
         
-        std::string line;
-        // Skip header
-        std::getline(file, line);
-        
-        while (std::getline(file, line)) {
-            std::istringstream iss(line);
-            std::string symbol, date;
-            double epsEstimate, actualEPS;
-            
-            std::getline(iss, symbol, ',');
-            iss >> epsEstimate;
-            iss.ignore(); // Skip comma
-            iss >> actualEPS;
-            iss.ignore(); // Skip comma
-            std::getline(iss, date);
-            
-            stocksMap.emplace(symbol, Stock(symbol, epsEstimate, actualEPS, date));
+        size_t total = 0;
+        for (const Group& group : groups) {
+            PartialGroup record = {};
+            std::memcpy(record.name, group.name.data(), std::min(group.name.size(), PARTIAL_NAME_SIZE));
+            record.eventCount = group.eventCount;
+            record.windowDays = static_cast<uint32_t>(group.windowDays);
+            record.rowCount = static_cast<uint32_t>(group.events.size());
+            file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+            file.write(reinterpret_cast<const char*>(group.sums.data()), group.windowDays * sizeof(double));
+            for (size_t i = 0; i < group.events.size(); i++) {
+                EventHandle h = group.events[i];
+                PartialRow row = {};
+                const std::string& symbol = events.symbol(h);
+                std::memcpy(row.symbol, symbol.data(), std::min(symbol.size(), PARTIAL_NAME_SIZE));
+                row.epsEstimate = events.epsEstimates[h];
+                row.actualEPS = events.actualEPS[h];
+                row.earningsDay = events.earningsDays[h];
+                file.write(reinterpret_cast<const char*>(&row), sizeof(row));
+                file.write(reinterpret_cast<const char*>(group.row(i)), group.windowDays * sizeof(double));
+            }
+            total += group.eventCount;
         }
         
         file.close();
+        if (!file) {
+            std::cerr << "Failed to write " << filename << std::endl;
+            return false;
+        }
+        std::cout << "Partial results for " << total << " event(s), shard " << shardIndex << "/" << shardCount
+                  << ", written to " << filename << std::endl;
+        return true;
     }
     
-    // Retrieve historical data for all stocks
-    void retrieveHistoricalData() {
-        // First, retrieve market data (SPY)
-        std::cout << "Retrieving market data (SPY)...\n";
-        marketPrices = marketData.fetchHistoricalData("SPY", "", "");
-        marketReturns = marketData.calculateMarketReturns(marketPrices);
+    // Merge one shard's partial results into the groups. The first file
+    // sets the window, return model and groups; the rest must match them. Sums and
+    // counts add up exactly, so AAR and CAAR are those of the whole input;
+    // the rows are merged as uniform samples for bootstrapping.
+    bool mergePartial(const std::string& filename) {
+        MappedFile file;
+        if (!file.open(filename)) {
+            std::cerr << "Failed to open file: " << filename << std::endl;
+            return false;
+        }
+        const char* data = reinterpret_cast<const char*>(file.data());
+        size_t size = file.size();
+        size_t offset = 0;
+        auto read = [&](void* out, size_t bytes) {
+            if (offset + bytes > size) return false;
+            std::memcpy(out, data + offset, bytes);
+            offset += bytes;
+            return true;
+        };
         
-        // Then retrieve data for each stock
-        int count = 0;
-        for (auto& pair : stocksMap) {
-            std::cout << "Retrieving data for " << pair.first << " (" << ++count << "/" << stocksMap.size() << ")\n";
-            Stock& stock = pair.second;
-            
-            // Fetch 61 days around earnings date (30 before, earnings day, 30 after)
-            std::vector<double> prices = marketData.fetchHistoricalData(stock.symbol, "", "");
-            
-            // Add prices to stock
-            stock.prices = prices;
-            
-            // Calculate returns
-            stock.calculateReturns();
-            
-            // Calculate abnormal returns
-            stock.calculateAbnormalReturns(marketReturns);
-            
-            // Categorize stock based on EPS surprise
-            if (stock.getGroup() == "Beat") {
-                beatGroup.addStock(&stock);
-            } else if (stock.getGroup() == "Meet") {
-                meetGroup.addStock(&stock);
-            } else {
-                missGroup.addStock(&stock);
+        PartialHeader header;
+        if (!read(&header, sizeof(header)) || std::memcmp(header.magic, PARTIAL_MAGIC, 8) != 0 ||
+            header.version != PARTIAL_VERSION || header.shardCount == 0 || header.shardIndex >= header.shardCount ||
+            header.window < 1 || header.window > INT32_MAX / 2 || header.returnModel > MARKET_MODEL ||
+            header.estimationFirst > INT32_MAX || header.estimationLast > INT32_MAX ||
+            !validEstimationWindow(static_cast<ReturnModel>(header.returnModel), static_cast<int>(header.estimationFirst),
+                                   static_cast<int>(header.estimationLast))) {
+            std::cerr << "Not a partial results file: " << filename << std::endl;
+            return false;
+        }
+        SurpriseClassifier next;
+        for (uint32_t i = 0; i < header.cutCount; i++) {
+            PartialCut cut;
+            if (!read(&cut, sizeof(cut))) break;
+            next.cuts.push_back(SurpriseClassifier::Cut{cut.value, cut.inclusive != 0});
+        }
+        
+        // Check the whole file before changing anything: every group's rows
+        // must have the window's days (an empty group may have none), there
+        // can't be more rows than events,
+        // and every part must lie inside the file (sizes are compared against
+        // the bytes left, so no product can wrap)
+        struct Part {
+            PartialGroup record;
+            size_t sums; // Offsets into the file
+            size_t rows;
+        };
+        const size_t days = 2 * static_cast<size_t>(header.window) + 1;
+        const size_t rowBytes = sizeof(PartialRow) + days * sizeof(double);
+        std::vector<Part> parts;
+        bool consistent = true;
+        for (uint32_t g = 0; consistent && g < header.groupCount; g++) {
+            Part part;
+            if (!read(&part.record, sizeof(part.record))) break;
+            size_t groupDays = part.record.windowDays;
+            consistent = (groupDays == days || (groupDays == 0 && part.record.eventCount == 0)) &&
+                         part.record.rowCount <= part.record.eventCount && groupDays * sizeof(double) <= size - offset;
+            if (!consistent) break;
+            part.sums = offset;
+            part.rows = offset + groupDays * sizeof(double);
+            consistent = part.record.rowCount <= (size - part.rows) / rowBytes;
+            if (!consistent) break;
+            offset = part.rows + part.record.rowCount * rowBytes;
+            next.names.push_back(std::string(part.record.name, strnlen(part.record.name, PARTIAL_NAME_SIZE)));
+            parts.push_back(part);
+        }
+        if (!consistent || next.cuts.size() != header.cutCount || parts.size() != header.groupCount ||
+            next.names.size() != next.cuts.size() + 1) {
+            std::cerr << "Truncated or inconsistent partial results file: " << filename << std::endl;
+            return false;
+        }
+        
+        // Then check it against the analysis
+        bool first = mergedShards.empty();
+        if (first) {
+            if (anyGrouped()) {
+                std::cerr << "Partial results can't be merged into groups that already hold events." << std::endl;
+                return false;
+            }
+        } else {
+            bool sameCuts = next.cuts.size() == classifier.cuts.size();
+            for (size_t i = 0; sameCuts && i < next.cuts.size(); i++) {
+                sameCuts = next.cuts[i].value == classifier.cuts[i].value && next.cuts[i].inclusive == classifier.cuts[i].inclusive;
+            }
+            bool sameModel = header.returnModel == static_cast<uint32_t>(returnModel) &&
+                             header.estimationFirst == static_cast<uint32_t>(estimationFirst) &&
+                             header.estimationLast == static_cast<uint32_t>(estimationLast);
+            if (header.window != static_cast<uint32_t>(eventWindow) || next.names != classifier.names || !sameCuts ||
+                !sameModel || header.shardCount != mergedShards.size()) {
+                std::cerr << filename << " comes from a run with a different window, return model, groups or shard count."
+                          << std::endl;
+                return false;
+            }
+            if (mergedShards[header.shardIndex]) {
+                std::cerr << "Shard " << header.shardIndex << " is already merged; skipping " << filename << std::endl;
+                return false;
             }
-            
-            // Add delay to avoid API rate limiting
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
         }
         
-        // Calculate AAR and CAAR for each group
-        calculateGroupMetrics();
-    }
-    
-    // Calculate AAR and CAAR for all groups
-    void calculateGroupMetrics() {
-        beatGroup.calculateAAR();
-        beatGroup.calculateCAAR();
+        // Nothing below can fail
+        if (first) {
+            setEventWindow(static_cast<int>(header.window));
+            setReturnModel(static_cast<ReturnModel>(header.returnModel), static_cast<int>(header.estimationFirst),
+                           static_cast<int>(header.estimationLast));
+            classifier = next;
+            buildGroups();
+            mergedShards.assign(header.shardCount, false);
+        }
         
-        meetGroup.calculateAAR();
-        meetGroup.calculateCAAR();
+        std::vector<EventHandle> handles;
+        std::vector<double> rows, sums;
+        bootstrapSummary.clear();
+        for (size_t g = 0; g < parts.size(); g++) {
+            const Part& part = parts[g];
+            if (part.record.eventCount == 0) continue;
+            handles.clear();
+            rows.resize(part.record.rowCount * days);
+            sums.resize(days);
+            std::memcpy(sums.data(), data + part.sums, days * sizeof(double));
+            offset = part.rows;
+            for (uint32_t i = 0; i < part.record.rowCount; i++) {
+                PartialRow row;
+                read(&row, sizeof(row));
+                read(rows.data() + i * days, days * sizeof(double));
+                handles.push_back(events.add(std::string_view(row.symbol, strnlen(row.symbol, PARTIAL_NAME_SIZE)),
+                                             row.epsEstimate, row.actualEPS, row.earningsDay));
+            }
+            groups[g].merge(handles, rows.data(), sums.data(), part.record.eventCount, days);
+        }
+        mergedShards[header.shardIndex] = true;
         
-        missGroup.calculateAAR();
-        missGroup.calculateCAAR();
+        size_t merged = std::count(mergedShards.begin(), mergedShards.end(), true);
+        std::cout << "Merged shard " << header.shardIndex << " from " << filename << " (" << merged << " of "
+                  << mergedShards.size() << " shards).\n";
+        return true;
     }
     
-    // Get stock by symbol
-    Stock* getStock(const std::string& symbol) {
-        auto it = stocksMap.find(symbol);
-        if (it != stocksMap.end()) {
-            return &(it->second);
-        }
-        return nullptr;
+    // Whether every shard's partial results have been merged
+    bool allShardsMerged() const {
+        return !mergedShards.empty() && std::count(mergedShards.begin(), mergedShards.end(), false) == 0;
     }
     
-    // Export CAAR data to CSV for visualization
-    void exportCAARtoCSV(const std::string& filename) {
-        std::ofstream file(filename);
+    // Whether the last bootstrap's results still describe the current groups
+    bool hasBootstrap() const {
+        return !bootstrapSummary.empty();
+    }
+    
+    // Save everything the queries and exports need: the events with their
+    // aligned prices and returns, the market series and calendar, the
+    // classifier, the groups' rows, sums, AAR and CAAR, and the last
+    // bootstrap's results. The file is written beside the target and renamed
+    // over it, since a restored analysis may still be reading the old one
+    // in place.
+    bool saveSnapshot(const std::string& filename) const {
+        ScopedTimer timer(Metrics::EXPORT);
+        std::string tmpPath = filename + ".tmp";
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
         if (!file.is_open()) {
-            std::cerr << "Failed to open file for writing: " << filename << std::endl;
-            return;
+            std::cerr << "Failed to open file for writing: " << tmpPath << std::endl;
+            return false;
         }
+        SnapshotHeader header = {};
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+        header.version = SNAPSHOT_VERSION;
+        header.window = static_cast<uint32_t>(eventWindow);
+        header.returnModel = static_cast<uint32_t>(returnModel);
+        header.estimationFirst = static_cast<uint32_t>(estimationFirst);
+        header.estimationLast = static_cast<uint32_t>(estimationLast);
+        header.groupCount = static_cast<uint32_t>(groups.size());
+        header.streamChunkEvents = streamChunkEvents;
+        header.streamRowCapacity = streamRowCapacity;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
         
-        // Write header
-        file << "Day,Beat,Meet,Miss\n";
+        events.writeSnapshot(file);
+        writeSnapshotArray(file, calendar.dates());
+        writeSnapshotArray(file, marketPrices);
+        writeSnapshotArray(file, marketReturns);
+        std::vector<double> cutValues;
+        std::vector<char> cutInclusive;
+        for (const SurpriseClassifier::Cut& cut : classifier.cuts) {
+            cutValues.push_back(cut.value);
+            cutInclusive.push_back(cut.inclusive ? 1 : 0);
+        }
+        writeSnapshotArray(file, cutValues);
+        writeSnapshotArray(file, cutInclusive);
+        for (const Group& group : groups) group.writeSnapshot(file);
+        writeSnapshotArray(file, bySurprise);
+        writeSnapshotArray(file, bootstrapRun, 3);
+        writeSnapshotArray(file, std::vector<uint64_t>(1, bootstrapSummary.size()));
+        for (const std::vector<BootstrapDay>& summary : bootstrapSummary) writeSnapshotArray(file, summary);
         
-        // Write data
-        size_t maxDays = std::max({beatGroup.caar.size(), meetGroup.caar.size(), missGroup.caar.size()});
+        file.close();
+        if (!file) {
+            std::cerr << "Failed to write " << tmpPath << std::endl;
+            std::remove(tmpPath.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        std::remove(filename.c_str()); // rename() won't replace a file here
+#endif
+        if (std::rename(tmpPath.c_str(), filename.c_str()) != 0) {
+            std::cerr << "Failed to replace " << filename << std::endl;
+            std::remove(tmpPath.c_str());
+            return false;
+        }
+        std::cout << "Snapshot of " << events.liveCount << " event(s) in " << groups.size() << " group(s) saved to "
+                  << filename << std::endl;
+        return true;
+    }
+    
+    // Replace the whole analysis with a snapshot's, so the stock and group
+    // queries work without fetching or computing anything. The file stays
+    // mapped: the price arena and the groups' rows are read in place, and
+    // are only copied out when something changes them, such as retrieving
+    // more stocks or regrouping. The small columns are copied, and checked
+    // as they are. The snapshot brings its own window, return model and
+    // groups. On failure nothing changes.
+    bool loadSnapshot(const std::string& filename) {
+        ScopedTimer timer(Metrics::LOAD);
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+        if (!file->open(filename)) {
+            std::cerr << "Failed to open file: " << filename << std::endl;
+            return false;
+        }
+        SnapshotReader in(file);
+        SnapshotHeader header;
+        if (!in.read(header) || std::memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0 || header.version != SNAPSHOT_VERSION ||
+            header.window < 1 || header.returnModel > MARKET_MODEL || header.groupCount == 0) {
+            std::cerr << "Not a snapshot file: " << filename << std::endl;
+            return false;
+        }
         
-        for (size_t day = 0; day < maxDays; day++) {
-            file << (day - 30) << ","; // Day relative to earnings announcement
-            
-            if (day < beatGroup.caar.size()) {
-                file << beatGroup.caar[day];
-            }
-            file << ",";
-            
-            if (day < meetGroup.caar.size()) {
-                file << meetGroup.caar[day];
-            }
-            file << ",";
-            
-            if (day < missGroup.caar.size()) {
-                file << missGroup.caar[day];
+        // Read into temporaries and check them before touching the analysis
+        EventStore store(static_cast<int>(header.window));
+        std::vector<int> dates;
+        std::vector<double> prices, returns, cutValues;
+        std::vector<char> cutInclusive;
+        bool valid = store.readSnapshot(in) && store.window == static_cast<int>(header.window) &&
+                     in.array(dates) && in.array(prices) && in.array(returns) && in.array(cutValues) &&
+                     in.array(cutInclusive) && cutValues.size() == cutInclusive.size() &&
+                     cutValues.size() + 1 == header.groupCount;
+        SurpriseClassifier next;
+        std::vector<Group> restored;
+        for (uint32_t g = 0; valid && g < header.groupCount; g++) {
+            restored.emplace_back("", &store, static_cast<int32_t>(g));
+            valid = restored.back().readSnapshot(in);
+            next.names.push_back(restored.back().name);
+        }
+        std::vector<EventHandle> sorted;
+        std::vector<uint64_t> run, summaryCount;
+        std::vector<std::vector<BootstrapDay>> summary;
+        valid = valid && in.array(sorted) && in.array(run) && run.size() == 3 && in.array(summaryCount) &&
+                summaryCount.size() == 1 && (summaryCount[0] == 0 || summaryCount[0] == header.groupCount);
+        for (uint64_t g = 0; valid && g < summaryCount[0]; g++) {
+            summary.emplace_back();
+            valid = in.array(summary.back());
+        }
+        for (size_t i = 0; valid && i < cutValues.size(); i++) {
+            next.cuts.push_back(SurpriseClassifier::Cut{cutValues[i], cutInclusive[i] != 0});
+        }
+        for (EventHandle h = 0; valid && h < store.size(); h++) {
+            valid = store.groupIds[h] >= EventStore::NO_GROUP && store.groupIds[h] < static_cast<int32_t>(header.groupCount);
+        }
+        for (size_t g = 0; valid && g < restored.size(); g++) {
+            for (size_t i = 0; valid && i < restored[g].events.size(); i++) {
+                EventHandle h = restored[g].events[i];
+                valid = store.groupIds[h] == static_cast<int32_t>(g) && store.groupRows[h] == i;
             }
-            file << "\n";
+        }
+        for (size_t i = 0; valid && i < sorted.size(); i++) valid = sorted[i] < store.size();
+        if (!valid || !in.ok()) {
+            std::cerr << "Truncated or inconsistent snapshot file: " << filename << std::endl;
+            return false;
         }
         
-        file.close();
-        std::cout << "CAAR data exported to " << filename << std::endl;
+        events = std::move(store);
+        for (Group& group : restored) group.store = &events;
+        groups = std::move(restored);
+        classifier = next;
+        bySurprise = std::move(sorted);
+        calendar.build(dates);
+        marketPrices = std::move(prices);
+        marketReturns = std::move(returns);
+        eventWindow = static_cast<int>(header.window);
+        returnModel = static_cast<ReturnModel>(header.returnModel);
+        estimationFirst = static_cast<int>(header.estimationFirst);
+        estimationLast = static_cast<int>(header.estimationLast);
+        streamChunkEvents = header.streamChunkEvents;
+        streamRowCapacity = std::max<size_t>(1, header.streamRowCapacity);
+        bootstrapSummary = std::move(summary);
+        std::copy(run.begin(), run.end(), bootstrapRun);
+        mergedShards.clear();
+        std::cout << "Restored " << events.liveCount << " event(s) for " << symbolCount() << " stock(s) in "
+                  << groups.size() << " group(s) from " << filename << std::endl;
+        return true;
     }
     
-    // Perform bootstrapping
-    void performBootstrapping(int sampleSize, int iterations) {
-        std::vector<std::vector<double>> beatCAARs(iterations);
-        std::vector<std::vector<double>> meetCAARs(iterations);
-        std::vector<std::vector<double>> missCAARs(iterations);
+    // Bootstrap CAAR statistics per group. Iterations are cut into fixed-size
+    // blocks that threads claim in turn; each iteration draws from its own
+    // counter-based RNG stream, samples rows in place and folds its CAAR into
+    // the block's streaming statistics (running moments and t-digests).
+    // Blocks are merged into the results in block order, so for a given seed
+    // the output is the same whatever the thread count. Given a table, every
+    // iteration's CAAR is also written to it, in iteration order.
+    std::vector<BootstrapStats> bootstrapStatistics(int sampleSize, int iterations, uint64_t seed,
+                                                    TableWriter* draws = nullptr) const {
+        const size_t groupCount = groups.size();
+        int blocks = (iterations + BOOTSTRAP_BLOCK_ITERATIONS - 1) / BOOTSTRAP_BLOCK_ITERATIONS;
+        unsigned threads = bootstrapThreadCount(iterations);
         
-        for (int i = 0; i < iterations; i++) {
-            std::cout << "Bootstrapping iteration " << (i+1) << "/" << iterations << std::endl;
-            
-            // Sample stocks from each group
-            std::vector<Stock*> beatSample = beatGroup.sampleStocks(sampleSize);
-            std::vector<Stock*> meetSample = meetGroup.sampleStocks(sampleSize);
-            std::vector<Stock*> missSample = missGroup.sampleStocks(sampleSize);
-            
-            // Create temporary groups with the samples
-            Group tempBeatGroup("TempBeat");
-            Group tempMeetGroup("TempMeet");
-            Group tempMissGroup("TempMiss");
-            
-            for (Stock* stock : beatSample) tempBeatGroup.addStock(stock);
-            for (Stock* stock : meetSample) tempMeetGroup.addStock(stock);
-            for (Stock* stock : missSample) tempMissGroup.addStock(stock);
-            
-            // Calculate AAR and CAAR for temporary groups
-            tempBeatGroup.calculateAAR();
-            tempBeatGroup.calculateCAAR();
-            tempMeetGroup.calculateAAR();
-            tempMeetGroup.calculateCAAR();
-            tempMissGroup.calculateAAR();
-            tempMissGroup.calculateCAAR();
+        std::vector<BootstrapStats> results;
+        for (size_t g = 0; g < groupCount; g++) results.emplace_back(groups[g].windowDays);
+        
+        std::atomic<int> nextBlock(0);
+        int mergedBlocks = 0;
+        std::mutex mergeMutex;
+        std::condition_variable merged;
+        
+        auto worker = [&]() {
+            std::vector<Group::RowSample> samples(groupCount);
+            std::vector<double> aar, caar;
+            std::vector<double> blockDraws; // Each iteration's CAAR for every group, when writing draws
+            std::vector<BootstrapStats> stats;
+            for (size_t g = 0; g < groupCount; g++) stats.emplace_back(groups[g].windowDays);
             
-            // Store CAAR values
-            beatCAARs[i] = tempBeatGroup.caar;
-            meetCAARs[i] = tempMeetGroup.caar;
-            missCAARs[i] = tempMissGroup.caar;
-        }
+            for (int block = nextBlock++; block < blocks; block = nextBlock++) {
+                int begin = block * BOOTSTRAP_BLOCK_ITERATIONS;
+                int end = std::min(iterations, begin + BOOTSTRAP_BLOCK_ITERATIONS);
+                for (size_t g = 0; g < groupCount; g++) stats[g].clear();
+                blockDraws.clear();
+                
+                for (int i = begin; i < end; i++) {
+                    for (size_t g = 0; g < groupCount; g++) {
+                        const Group& group = groups[g];
+                        if (group.events.empty()) continue;
+                        CounterRng rng(seed, static_cast<uint64_t>(i) * groupCount + g);
+                        size_t count = group.sampleRows(sampleSize, samples[g], rng);
+                        caar.resize(group.windowDays);
+                        group.sampleCAAR(samples[g].indices.data(), count, aar, caar.data());
+                        stats[g].add(caar.data());
+                        if (draws) blockDraws.insert(blockDraws.end(), caar.begin(), caar.end());
+                    }
+                }
+                
+                // Wait for the earlier blocks, which are already claimed, then merge
+                std::unique_lock<std::mutex> lock(mergeMutex);
+                merged.wait(lock, [&] { return mergedBlocks == block; });
+                for (size_t g = 0; g < groupCount; g++) results[g].merge(stats[g]);
+                if (draws) {
+                    const double* draw = blockDraws.data();
+                    for (int i = begin; i < end; i++) {
+                        for (size_t g = 0; g < groupCount; g++) {
+                            if (groups[g].events.empty()) continue;
+                            for (size_t day = 0; day < groups[g].windowDays; day++) {
+                                draws->integer(i);
+                                draws->text(groups[g].name);
+                                draws->integer(static_cast<int>(day) - eventWindow);
+                                draws->number(*draw++);
+                                draws->endRow();
+                            }
+                        }
+                    }
+                }
+                mergedBlocks++;
+                merged.notify_all();
+            }
+        };
         
-        // Calculate average CAAR across bootstrapping iterations
-        std::vector<double> avgBeatCAAR;
-        std::vector<double> avgMeetCAAR;
-        std::vector<double> avgMissCAAR;
+        std::vector<std::thread> pool;
+        for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker);
+        worker();
+        for (std::thread& thread : pool) thread.join();
+        return results;
+    }
+    
+    // Threads a bootstrap of the given length runs on
+    unsigned bootstrapThreadCount(int iterations) const {
+        unsigned threads = bootstrapThreads > 0 ? bootstrapThreads : std::max(1u, std::thread::hardware_concurrency());
+        int blocks = (iterations + BOOTSTRAP_BLOCK_ITERATIONS - 1) / BOOTSTRAP_BLOCK_ITERATIONS;
+        return std::min(threads, static_cast<unsigned>(blocks));
+    }
+    
+    // Perform bootstrapping and export the mean CAAR per group, its standard
+    // error and 95% bands. With drawsFilename, every iteration's CAAR is
+    // exported there too.
+    bool performBootstrapping(int sampleSize, int iterations, const std::string& filename = "bootstrapped_caar.csv",
+                              const std::string& drawsFilename = "") {
+        if (sampleSize <= 0 || iterations <= 0) {
+            std::cerr << "Sample size and iterations must be positive." << std::endl;
+            return false;
+        }
         
-        // Find the minimum size across all iterations
-        size_t minBeatSize = std::numeric_limits<size_t>::max();
-        size_t minMeetSize = std::numeric_limits<size_t>::max();
-        size_t minMissSize = std::numeric_limits<size_t>::max();
+        uint64_t seed = bootstrapSeed;
+        if (seed == 0) {
+            std::random_device rd;
+            seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+        }
         
-        for (const auto& caar : beatCAARs) minBeatSize = std::min(minBeatSize, caar.size());
-        for (const auto& caar : meetCAARs) minMeetSize = std::min(minMeetSize, caar.size());
-        for (const auto& caar : missCAARs) minMissSize = std::min(minMissSize, caar.size());
+        TableWriter draws(exportFormat, exportPrecision);
+        if (!drawsFilename.empty() &&
+            !draws.open(drawsFilename, {{"Iteration", TableWriter::INTEGER, 0}, {"Group", TableWriter::TEXT, 16},
+                                        {"Day", TableWriter::INTEGER, 0}, {"CAAR", TableWriter::NUMBER, 0}})) {
+            return false;
+        }
         
-        // Initialize average vectors
-        avgBeatCAAR.resize(minBeatSize, 0.0);
-        avgMeetCAAR.resize(minMeetSize, 0.0);
-        avgMissCAAR.resize(minMissSize, 0.0);
+        std::cout << "Bootstrapping " << iterations << " iterations on " << bootstrapThreadCount(iterations)
+                  << " thread(s), seed " << seed << "..." << std::endl;
+        std::vector<BootstrapStats> results;
+        {
+            ScopedTimer timer(Metrics::BOOTSTRAP);
+            results = bootstrapStatistics(sampleSize, iterations, seed, drawsFilename.empty() ? nullptr : &draws);
+        }
         
-        // Sum across iterations
-        for (int i = 0; i < iterations; i++) {
-            for (size_t day = 0; day < minBeatSize; day++) {
-                avgBeatCAAR[day] += beatCAARs[i][day];
-            }
-            for (size_t day = 0; day < minMeetSize; day++) {
-                avgMeetCAAR[day] += meetCAARs[i][day];
-            }
-            for (size_t day = 0; day < minMissSize; day++) {
-                avgMissCAAR[day] += missCAARs[i][day];
+        // Keep the mean CAAR, its standard error and 95% bands
+        bootstrapSummary.assign(groups.size(), std::vector<BootstrapDay>());
+        for (size_t g = 0; g < results.size(); g++) {
+            BootstrapStats& result = results[g];
+            for (size_t day = 0; day < result.days(); day++) {
+                const RunningMoments& moments = result.moments[day];
+                bootstrapSummary[g].push_back(BootstrapDay{moments.count, moments.mean, moments.stddev(),
+                                                           result.digests[day].quantile(0.025),
+                                                           result.digests[day].quantile(0.975)});
             }
         }
+        bootstrapRun[0] = static_cast<uint64_t>(sampleSize);
+        bootstrapRun[1] = static_cast<uint64_t>(iterations);
+        bootstrapRun[2] = seed;
         
-        // Calculate averages
-        for (size_t day = 0; day < minBeatSize; day++) {
-            avgBeatCAAR[day] /= iterations;
+        if (!drawsFilename.empty()) {
+            ScopedTimer timer(Metrics::EXPORT);
+            if (!draws.close()) return false;
+            std::cout << "Bootstrap draws exported to " << drawsFilename << std::endl;
         }
-        for (size_t day = 0; day < minMeetSize; day++) {
-            avgMeetCAAR[day] /= iterations;
+        return exportBootstrap(filename);
+    }
+    
+    // Export the last bootstrap's mean CAAR per group, its standard error
+    // and 95% bands
+    bool exportBootstrap(const std::string& filename) {
+        if (bootstrapSummary.empty()) {
+            std::cerr << "No bootstrap results for the current groups; perform bootstrapping first." << std::endl;
+            return false;
         }
-        for (size_t day = 0; day < minMissSize; day++) {
-            avgMissCAAR[day] /= iterations;
+        ScopedTimer timer(Metrics::EXPORT);
+        std::vector<TableWriter::Column> columns = {{"Day", TableWriter::INTEGER, 0}};
+        for (const char* suffix : {"", "_SE", "_Lower95", "_Upper95"}) {
+            for (const Group& group : groups) columns.push_back({group.name + suffix, TableWriter::NUMBER, 0});
         }
+        TableWriter table(exportFormat, exportPrecision);
+        if (!table.open(filename, columns)) return false;
         
-        // Export bootstrapped results
-        std::ofstream file("bootstrapped_caar.csv");
-        if (file.is_open()) {
-            file << "Day,Beat,Meet,Miss\n";
-            
-            size_t maxDays = std::max({minBeatSize, minMeetSize, minMissSize});
-            
-            for (size_t day = 0; day < maxDays; day++) {
-                file << (day - 30) << ","; // Day relative to earnings announcement
-                
-                if (day < minBeatSize) {
-                    file << avgBeatCAAR[day];
-                }
-                file << ",";
-                
-                if (day < minMeetSize) {
-                    file << avgMeetCAAR[day];
-                }
-                file << ",";
-                
-                if (day < minMissSize) {
-                    file << avgMissCAAR[day];
+        size_t maxDays = 0;
+        for (const std::vector<BootstrapDay>& summary : bootstrapSummary) maxDays = std::max(maxDays, summary.size());
+        
+        for (size_t day = 0; day < maxDays; day++) {
+            table.integer(static_cast<int>(day) - eventWindow); // Day relative to earnings announcement
+            for (int column = 0; column < 4; column++) {
+                for (const std::vector<BootstrapDay>& summary : bootstrapSummary) {
+                    if (day >= summary.size() || summary[day].iterations == 0) table.missing();
+                    else if (column == 0) table.number(summary[day].mean);
+                    else if (column == 1) table.number(summary[day].standardError);
+                    else if (column == 2) table.number(summary[day].lower95);
+                    else table.number(summary[day].upper95);
                 }
-                file << "\n";
             }
-            
-            file.close();
-            std::cout << "Bootstrapped CAAR data exported to bootstrapped_caar.csv" << std::endl;
+            table.endRow();
         }
+        
+        if (!table.close()) return false;
+        std::cout << "Bootstrapped CAAR data exported to " << filename << std::endl;
+        return true;
     }
     
-    // Display information about a specific stock
+    // Display information about every event of a specific stock
     void displayStockInfo(const std::string& symbol) {
-        Stock* stock = getStock(symbol);
-        if (!stock) {
+        std::vector<EventHandle> found = getEvents(symbol);
+        if (found.empty()) {
             std::cout << "Stock " << symbol << " not found.\n";
             return;
         }
-        
+        for (EventHandle h : found) displayEventInfo(h);
+    }
+    
+    // Display one earnings event
+    void displayEventInfo(EventHandle h) {
+        SeriesView prices = events.prices(h);
+        SeriesView abnormalReturns = events.abnormalReturns(h);
         std::cout << "===== Stock Information =====\n";
-        std::cout << "Symbol: " << stock->symbol << "\n";
-        std::cout << "EPS Estimate: " << stock->epsEstimate << "\n";
-        std::cout << "Actual EPS: " << stock->actualEPS << "\n";
-        std::cout << "Surprise %: " << stock->getSurprisePercentage() << "%\n";
-        std::cout << "Group: " << stock->getGroup() << "\n";
-        std::cout << "Earnings Date: " << stock->earningsDate << "\n";
+        std::cout << "Symbol: " << events.symbol(h) << "\n";
+        std::cout << "EPS Estimate: " << events.epsEstimates[h] << "\n";
+        std::cout << "Actual EPS: " << events.actualEPS[h] << "\n";
+        std::cout << "Surprise %: " << events.surprises[h] << "%\n";
+        std::cout << "Group: " << classifier.names[classifier.classify(events.surprises[h])] << "\n";
+        std::cout << "Earnings Date: " << formatDate(events.earningsDays[h]) << "\n";
         std::cout << "\nPrices around earnings date:\n";
         
         // Display a subset of prices
-        int midPoint = stock->prices.size() / 2;
+        int midPoint = prices.size() / 2;
         int start = std::max(0, midPoint - 5);
-        int end = std::min(static_cast<int>(stock->prices.size()) - 1, midPoint + 5);
+        int end = std::min(static_cast<int>(prices.size()) - 1, midPoint + 5);
         
         for (int i = start; i <= end; i++) {
-            std::cout << "Day " << (i - midPoint) << ": $" << std::fixed << std::setprecision(2) << stock->prices[i] << "\n";
+            std::cout << "Day " << (i - midPoint) << ": $" << std::fixed << std::setprecision(2) << prices[i] << "\n";
         }
         
         std::cout << "\nAbnormal Returns around earnings date:\n";
         start = std::max(0, midPoint - 5 - 1); // -1 because returns have one less element than prices
-        end = std::min(static_cast<int>(stock->abnormalReturns.size()) - 1, midPoint + 5 - 1);
+        end = std::min(static_cast<int>(abnormalReturns.size()) - 1, midPoint + 5 - 1);
         
         for (int i = start; i <= end; i++) {
             std::cout << "Day " << (i - (midPoint-1)) << ": " 
-                     << std::fixed << std::setprecision(4) << stock->abnormalReturns[i] * 100 << "%\n";
+                     << std::fixed << std::setprecision(4) << abnormalReturns[i] * 100 << "%\n";
         }
     }
     
     // Display AAR or CAAR for a group
     void displayGroupMetrics(const std::string& groupName, bool showCAAR) {
-        Group* group = nullptr;
-        
-        if (groupName == "Beat") group = &beatGroup;
-        else if (groupName == "Meet") group = &meetGroup;
-        else if (groupName == "Miss") group = &missGroup;
+        Group* group = findGroup(groupName);
         
         if (!group) {
-            std::cout << "Invalid group name. Please choose Beat, Meet, or Miss.\n";
+            std::cout << "Invalid group name. Please choose one of: " << groupList() << ".\n";
             return;
         }
         
         std::cout << "===== " << groupName << " Group " << (showCAAR ? "CAAR" : "AAR") << " =====\n";
-        std::cout << "Number of stocks: " << group->stocks.size() << "\n\n";
+        std::cout << "Number of stocks: " << group->eventCount << "\n\n";
         
         const std::vector<double>& data = showCAAR ? group->caar : group->aar;
         
-        std::cout << "Day\t" << (showCAAR ? "CAAR" : "AAR") << "\n";
+        // The last bootstrap's bands, while they still describe this grouping
+        const std::vector<BootstrapDay>* bands = nullptr;
+        size_t index = group - groups.data();
+        if (showCAAR && index < bootstrapSummary.size() && bootstrapSummary[index].size() == data.size()) {
+            bands = &bootstrapSummary[index];
+        }
+        
+        std::cout << "Day\t" << (showCAAR ? "CAAR" : "AAR") << (bands ? "\tBootstrap 95% band" : "") << "\n";
         for (size_t i = 0; i < data.size(); i++) {
-            std::cout << (i - 30) << "\t" << std::fixed << std::setprecision(6) << data[i] * 100 << "%\n";
+            std::cout << (static_cast<int>(i) - eventWindow) << "\t" << std::fixed << std::setprecision(6) << data[i] * 100 << "%";
+            if (bands && (*bands)[i].iterations > 0) {
+                std::cout << "\t" << (*bands)[i].lower95 * 100 << "% to " << (*bands)[i].upper95 * 100 << "%";
+            }
+            std::cout << "\n";
         }
     }
     
@@ -551,8 +5705,7 @@ public:
         std::cout << "===== Stock Performance Analysis =====\n";
         std::cout << "Enter your Alpha Vantage API key: ";
         std::getline(std::cin, apiKey);
-        
-        MarketData md(apiKey);
+        marketData.setApiKey(apiKey);
         
         do {
             std::cout << "\nMenu:\n";
@@ -563,7 +5716,10 @@ public:
             std::cout << "5. Show CAAR for one group\n";
             std::cout << "6. Export CAAR data to CSV\n";
             std::cout << "7. Perform bootstrapping\n";
-            std::cout << "8. Exit\n";
+            std::cout << "8. Set surprise groups\n";
+            std::cout << "9. Save snapshot\n";
+            std::cout << "10. Load snapshot\n";
+            std::cout << "11. Exit\n";
             std::cout << "Enter your choice: ";
             std::cin >> choice;
             std::cin.ignore(); // Clear the newline
@@ -572,9 +5728,8 @@ public:
                 case 1: {
                     std::cout << "Enter stocks file path: ";
                     std::getline(std::cin, stocksFile);
-                    loadStockDataFromFile(stocksFile);
-                    std::cout << "Loaded " << stocksMap.size() << " stocks.\n";
-                    dataLoaded = true;
+                    if (loadStockDataFromFile(stocksFile)) dataLoaded = true;
+                    std::cout << "Loaded " << events.liveCount << " earnings events for " << symbolCount() << " stocks.\n";
                     break;
                 }
                 case 2: {
@@ -602,7 +5757,7 @@ public:
                         break;
                     }
                     std::string group;
-                    std::cout << "Enter group (Beat, Meet, Miss): ";
+                    std::cout << "Enter group (" << groupList() << "): ";
                     std::getline(std::cin, group);
                     displayGroupMetrics(group, false); // Show AAR
                     break;
@@ -613,7 +5768,7 @@ public:
                         break;
                     }
                     std::string group;
-                    std::cout << "Enter group (Beat, Meet, Miss): ";
+                    std::cout << "Enter group (" << groupList() << "): ";
                     std::getline(std::cin, group);
                     displayGroupMetrics(group, true); // Show CAAR
                     break;
@@ -626,7 +5781,7 @@ public:
                     std::string filename;
                     std::cout << "Enter output filename (e.g., caar_data.csv): ";
                     std::getline(std::cin, filename);
-                    exportCAARtoCSV(filename);
+                    exportCAAR(filename);
                     break;
                 }
                 case 7: {
@@ -640,29 +5795,721 @@ public:
                     std::cout << "Enter number of iterations: ";
                     std::cin >> iterations;
                     std::cin.ignore(); // Clear the newline
-                    performBootstrapping(sampleSize, iterations);
+                    std::string seedText;
+                    std::cout << "Enter random seed (blank for a fresh seed): ";
+                    std::getline(std::cin, seedText);
+                    uint64_t seed = 0;
+                    std::from_chars(seedText.data(), seedText.data() + seedText.size(), seed);
+                    setBootstrapSeed(seed);
+                    std::string filename;
+                    std::cout << "Enter output filename (blank for bootstrapped_caar.csv): ";
+                    std::getline(std::cin, filename);
+                    performBootstrapping(sampleSize, iterations, filename.empty() ? "bootstrapped_caar.csv" : filename);
+                    break;
+                }
+                case 8: {
+                    int quantiles;
+                    std::cout << "Enter number of quantile groups (0 for Beat/Meet/Miss): ";
+                    std::cin >> quantiles;
+                    if (quantiles > 0) {
+                        std::cin.ignore(); // Clear the newline
+                        setQuantileGroups(quantiles);
+                        break;
+                    }
+                    double beatAbove, missBelow;
+                    std::cout << "Enter beat threshold in %: ";
+                    std::cin >> beatAbove;
+                    std::cout << "Enter miss threshold in %: ";
+                    std::cin >> missBelow;
+                    std::cin.ignore(); // Clear the newline
+                    setSurpriseThresholds(beatAbove, missBelow);
+                    break;
+                }
+                case 9: {
+                    if (!dataLoaded) {
+                        std::cout << "Please load stocks from file first (option 1).\n";
+                        break;
+                    }
+                    std::string filename;
+                    std::cout << "Enter snapshot filename (blank for analysis.snapshot): ";
+                    std::getline(std::cin, filename);
+                    saveSnapshot(filename.empty() ? "analysis.snapshot" : filename);
+                    break;
+                }
+                case 10: {
+                    std::string filename;
+                    std::cout << "Enter snapshot filename (blank for analysis.snapshot): ";
+                    std::getline(std::cin, filename);
+                    if (loadSnapshot(filename.empty() ? "analysis.snapshot" : filename)) dataLoaded = true;
                     break;
                 }
-                case 8:
+                case 11:
                     std::cout << "Exiting...\n";
                     break;
                 default:
                     std::cout << "Invalid choice. Try again.\n";
             }
-        } while (choice != 8);
+        } while (choice != 11);
     }
 };
 
-int main() {
+// Settings for an unattended run, from command-line flags or a config file
+struct BatchOptions {
+    std::string input;
+    std::string apiKey;
+    int window = StockAnalyzer::DEFAULT_EVENT_WINDOW;
+    double beatThreshold = 5.0;
+    double missThreshold = -5.0;
+    ReturnModel returnModel = MARKET_ADJUSTED;
+    int estimationFirst = StockAnalyzer::DEFAULT_ESTIMATION_FIRST; // Days -first to -last before earnings
+    int estimationLast = StockAnalyzer::DEFAULT_ESTIMATION_LAST;
+    int quantiles = 0; // Quantile groups instead of Beat/Meet/Miss when 2 or more
+    int bootstrapSize = 0;
+    int bootstrapIterations = 0; // 0 skips bootstrapping
+    int bootstrapThreads = 0;
+    uint64_t seed = 0;
+    std::string caarOutput = "caar_data.csv";
+    std::string bootstrapOutput = "bootstrapped_caar.csv";
+    std::string drawsOutput; // Every bootstrap iteration's CAAR, if set
+    std::string abnormalReturnsOutput; // Every event's abnormal returns, if set
+    ExportFormat exportFormat = EXPORT_CSV;
+    int exportPrecision = 6; // 0 for the shortest exact form
+    uint32_t shardIndex = 0; // This run loads the symbols of shard shardIndex of shardCount
+    uint32_t shardCount = 1;
+    std::string partialOutput; // Partial results for a reduce step, written instead of the reports
+    std::vector<std::string> reduceInputs; // Partial results to merge instead of loading an input
+    std::string restoreInput; // Snapshot to restore instead of loading an input
+    std::string snapshotOutput; // Snapshot of the finished analysis, if set
+    std::vector<int> sweepWindows; // A sweep runs when either list is set; an empty one takes --window
+    std::vector<std::pair<double, double>> sweepThresholds; // (beat, miss) pairs, or --thresholds
+    std::string sweepOutput = "sweep.csv";
+    std::string provider = "alphavantage"; // Or local:DIR, bulk:URL
+    std::string cacheDir = MarketData::DEFAULT_CACHE_DIRECTORY;
+    int maxConcurrent = MarketData::DEFAULT_MAX_CONCURRENT;
+    double requestsPerMinute = MarketData::DEFAULT_REQUESTS_PER_MINUTE;
+    int maxRetries = FetchEngine::DEFAULT_MAX_ATTEMPTS - 1;
+    size_t streamChunk = 0; // 0 keeps every event in memory
+    size_t streamRows = StockAnalyzer::DEFAULT_STREAM_ROWS;
+    
+    // Benchmark mode, run instead of the analysis when a format is set
+    std::string benchmarkFormat; // json or csv
+    std::string benchmarkOutput; // Empty writes to stdout
+    std::vector<int> benchmarkStocks = {100, 1000, 10000, 100000};
+    std::vector<int> benchmarkDays = {60, 250, 1000, 5000};
+    double benchmarkMemoryMB = 2048; // Larger configurations are skipped
+    
+    std::string metricsOutput; // Metrics file written at exit, if set
+    std::string metricsFormat = "json"; // json or prometheus
+};
+
+// Print command-line usage
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [--option value ...]\n"
+              << "With no options, runs the interactive menu. Otherwise runs load, fetch,\n"
+              << "compute, export and (optionally) bootstrap unattended.\n\n"
+              << "  --config FILE              Read key=value options from FILE (keys as below, without --)\n"
+              << "  --input FILE               Stocks CSV (required)\n"
+              << "  --api-key KEY              Alpha Vantage key (default: $ALPHAVANTAGE_API_KEY)\n"
+              << "  --window DAYS              Trading days either side of earnings (default 30)\n"
+              << "  --thresholds BEAT,MISS     Surprise % thresholds (default 5,-5)\n"
+              << "  --quantiles N              Group into N surprise quantiles instead\n"
+              << "  --model MODEL              market-adjusted, or market-model for OLS alpha and beta (default\n"
+              << "                             market-adjusted)\n"
+              << "  --estimation-window A,B    Market model fitted over days -A to -B (default 250,31)\n"
+              << "  --bootstrap-size N         Stocks sampled per group per iteration\n"
+              << "  --bootstrap-iterations N   Bootstrap iterations (default 0: skip)\n"
+              << "  --bootstrap-threads N      Bootstrap threads (default: all)\n"
+              << "  --seed N                   Bootstrap seed (default: random)\n"
+              << "  --caar-output FILE         CAAR table (default caar_data.csv)\n"
+              << "  --bootstrap-output FILE    Bootstrap table (default bootstrapped_caar.csv)\n"
+              << "  --draws-output FILE        Every bootstrap iteration's CAAR (default: not written)\n"
+              << "  --ar-output FILE           Every event's abnormal returns (default: not written)\n"
+              << "  --export-format FORMAT     csv, or npy for a directory of numpy column files (default csv)\n"
+              << "  --export-precision N       Significant digits in CSV, 0 for exact (default 6)\n"
+              << "  --shard I/N                Load only the symbols of shard I of N (0-based)\n"
+              << "  --partial-output FILE      Write the shard's partial results for --reduce, instead of reports\n"
+              << "  --reduce FILE,...          Merge every shard's partial results, then export and bootstrap\n"
+              << "  --snapshot-output FILE     Save the finished analysis for --restore (default: not written)\n"
+              << "  --restore FILE             Restore a snapshot instead of loading and fetching, then export\n"
+              << "  --sweep-windows N,...      Sweep these windows, writing one table instead of the reports\n"
+              << "  --sweep-thresholds B:M,... Sweep these Beat:Miss threshold pairs, e.g. 5:-5,2:-2\n"
+              << "  --sweep-output FILE        Sweep table (default sweep.csv)\n"
+              << "  --provider SOURCE          alphavantage, local:DIR for a snapshot directory, or bulk:URL for a\n"
+              << "                             multi-symbol endpoint with {symbols} {start} {end} {key} (default alphavantage)\n"
+              << "  --cache-dir DIR            Price cache directory, empty to disable (default price_cache)\n"
+              << "  --max-concurrent N         Requests in flight at once (default 8)\n"
+              << "  --rate-limit N             Requests per minute, 0 for no limit (default 60)\n"
+              << "  --max-retries N            Retries per failed or throttled request (default 4)\n"
+              << "  --stream-chunk N           Stream events in chunks of about N, dropping prices as they go\n"
+              << "  --stream-rows N            Rows per group kept for bootstrapping when streaming (default 10000)\n"
+              << "  --metrics-output FILE      Write run metrics to FILE at exit\n"
+              << "  --metrics-format FORMAT    json or prometheus (default json)\n\n"
+              << "  --benchmark FORMAT         Time the stages on synthetic data instead (json or csv)\n"
+              << "  --benchmark-output FILE    Benchmark results (default: stdout)\n"
+              << "  --benchmark-stocks N,...   Stock counts (default 100,1000,10000,100000)\n"
+              << "  --benchmark-days N,...     Event window lengths in trading days (default 60,250,1000,5000)\n"
+              << "  --benchmark-memory-mb N    Skip configurations needing more memory (default 2048)\n";
+}
+
+// Parse a whole field as an integer
+template <typename T>
+bool parseInteger(std::string_view field, T& value) {
+    field = trimField(field);
+    const char* end = field.data() + field.size();
+    std::from_chars_result result = std::from_chars(field.data(), end, value);
+    return !field.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+// Parse a comma-separated list of positive integers
+bool parseIntegerList(std::string_view field, std::vector<int>& values) {
+    values.clear();
+    while (!field.empty()) {
+        int value;
+        if (!parseInteger(nextField(field), value) || value <= 0) return false;
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+// Apply one option by name
+bool setBatchOption(BatchOptions& options, const std::string& key, const std::string& value) {
+    bool valid = true;
+    if (key == "input") options.input = value;
+    else if (key == "api-key") options.apiKey = value;
+    else if (key == "window") valid = parseInteger(value, options.window) && options.window > 0;
+    else if (key == "thresholds") {
+        std::string_view fields(value);
+        valid = parseNumber(nextField(fields), options.beatThreshold) && parseNumber(fields, options.missThreshold);
+    }
+    else if (key == "model") {
+        options.returnModel = value == "market-model" ? MARKET_MODEL : MARKET_ADJUSTED;
+        valid = value == "market-adjusted" || value == "market-model";
+    }
+    else if (key == "estimation-window") {
+        std::string_view fields(value);
+        valid = parseInteger(nextField(fields), options.estimationFirst) && parseInteger(fields, options.estimationLast) &&
+                options.estimationLast >= 1 && options.estimationFirst >= options.estimationLast;
+    }
+    else if (key == "quantiles") valid = parseInteger(value, options.quantiles) && options.quantiles >= 0;
+    else if (key == "bootstrap-size") valid = parseInteger(value, options.bootstrapSize) && options.bootstrapSize > 0;
+    else if (key == "bootstrap-iterations") valid = parseInteger(value, options.bootstrapIterations) && options.bootstrapIterations >= 0;
+    else if (key == "bootstrap-threads") valid = parseInteger(value, options.bootstrapThreads) && options.bootstrapThreads >= 0;
+    else if (key == "seed") valid = parseInteger(value, options.seed);
+    else if (key == "caar-output") options.caarOutput = value;
+    else if (key == "bootstrap-output") options.bootstrapOutput = value;
+    else if (key == "draws-output") options.drawsOutput = value;
+    else if (key == "ar-output") options.abnormalReturnsOutput = value;
+    else if (key == "export-format") {
+        options.exportFormat = value == "npy" ? EXPORT_NPY : EXPORT_CSV;
+        valid = value == "csv" || value == "npy";
+    }
+    else if (key == "export-precision") valid = parseInteger(value, options.exportPrecision) && options.exportPrecision >= 0 && options.exportPrecision <= 17;
+    else if (key == "shard") {
+        std::string_view text(value);
+        size_t slash = text.find('/');
+        valid = slash != std::string_view::npos && parseInteger(text.substr(0, slash), options.shardIndex) &&
+                parseInteger(text.substr(slash + 1), options.shardCount) && options.shardCount > 0 &&
+                options.shardIndex < options.shardCount;
+    }
+    else if (key == "partial-output") options.partialOutput = value;
+    else if (key == "restore") options.restoreInput = value;
+    else if (key == "snapshot-output") options.snapshotOutput = value;
+    else if (key == "reduce") {
+        options.reduceInputs.clear();
+        std::string_view files(value);
+        while (!files.empty()) {
+            std::string_view file = trimField(nextField(files));
+            if (!file.empty()) options.reduceInputs.emplace_back(file);
+        }
+        valid = !options.reduceInputs.empty();
+    }
+    else if (key == "sweep-windows") valid = parseIntegerList(value, options.sweepWindows);
+    else if (key == "sweep-thresholds") {
+        options.sweepThresholds.clear();
+        std::string_view pairs(value);
+        valid = !pairs.empty();
+        while (valid && !pairs.empty()) {
+            std::string_view pair = trimField(nextField(pairs));
+            size_t colon = pair.find(':');
+            double beat, miss;
+            valid = colon != std::string_view::npos && parseNumber(pair.substr(0, colon), beat) &&
+                    parseNumber(pair.substr(colon + 1), miss) && beat >= miss;
+            if (valid) options.sweepThresholds.emplace_back(beat, miss);
+        }
+    }
+    else if (key == "sweep-output") options.sweepOutput = value;
+    else if (key == "provider") {
+        options.provider = value;
+        valid = MarketData::isProviderSpec(value);
+    }
+    else if (key == "cache-dir") options.cacheDir = value;
+    else if (key == "max-concurrent") valid = parseInteger(value, options.maxConcurrent) && options.maxConcurrent > 0;
+    else if (key == "rate-limit") valid = parseNumber(value, options.requestsPerMinute) && options.requestsPerMinute >= 0;
+    else if (key == "max-retries") valid = parseInteger(value, options.maxRetries) && options.maxRetries >= 0;
+    else if (key == "stream-chunk") valid = parseInteger(value, options.streamChunk);
+    else if (key == "stream-rows") valid = parseInteger(value, options.streamRows) && options.streamRows > 0;
+    else if (key == "benchmark") {
+        options.benchmarkFormat = value;
+        valid = value == "json" || value == "csv";
+    }
+    else if (key == "benchmark-output") options.benchmarkOutput = value;
+    else if (key == "metrics-output") options.metricsOutput = value;
+    else if (key == "metrics-format") {
+        options.metricsFormat = value;
+        valid = value == "json" || value == "prometheus";
+    }
+    else if (key == "benchmark-stocks") valid = parseIntegerList(value, options.benchmarkStocks);
+    else if (key == "benchmark-days") valid = parseIntegerList(value, options.benchmarkDays);
+    else if (key == "benchmark-memory-mb") valid = parseNumber(value, options.benchmarkMemoryMB) && options.benchmarkMemoryMB > 0;
+    else {
+        std::cerr << "Unknown option: " << key << std::endl;
+        return false;
+    }
+    if (!valid) std::cerr << "Invalid value for " << key << ": " << value << std::endl;
+    return valid;
+}
+
+// Read key=value options, one per line; # starts a comment
+bool loadBatchConfig(BatchOptions& options, const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open config file: " << filename << std::endl;
+        return false;
+    }
+    
+    std::string text;
+    for (size_t lineNumber = 1; std::getline(file, text); lineNumber++) {
+        std::string_view line(text);
+        line = trimField(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+        
+        size_t equals = line.find('=');
+        if (equals == std::string_view::npos) {
+            std::cerr << filename << ":" << lineNumber << ": expected key=value" << std::endl;
+            return false;
+        }
+        std::string key(trimField(line.substr(0, equals)));
+        std::string value(trimField(line.substr(equals + 1)));
+        if (!setBatchOption(options, key, value)) return false;
+    }
+    return true;
+}
+
+// Parse --key value and --key=value flags; later flags override earlier ones
+// and the config file, wherever --config appears
+bool parseArguments(int argc, char* argv[], BatchOptions& options) {
+    std::vector<std::pair<std::string, std::string>> flags;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            std::cerr << "Unexpected argument: " << arg << std::endl;
+            return false;
+        }
+        arg.erase(0, 2);
+        
+        size_t equals = arg.find('=');
+        if (equals != std::string::npos) {
+            flags.emplace_back(arg.substr(0, equals), arg.substr(equals + 1));
+        } else if (i + 1 < argc) {
+            flags.emplace_back(arg, argv[++i]);
+        } else {
+            std::cerr << "Missing value for --" << arg << std::endl;
+            return false;
+        }
+    }
+    
+    for (const auto& flag : flags) {
+        if (flag.first == "config" && !loadBatchConfig(options, flag.second)) return false;
+    }
+    for (const auto& flag : flags) {
+        if (flag.first != "config" && !setBatchOption(options, flag.first, flag.second)) return false;
+    }
+    return true;
+}
+
+// Run load, fetch, compute, export and bootstrap without prompting
+bool runBatch(const BatchOptions& options) {
+    bool reducing = !options.reduceInputs.empty();
+    bool restoring = !options.restoreInput.empty();
+    if (options.input.empty() && !reducing && !restoring) {
+        std::cerr << "No input file given (--input, --reduce for partial results or --restore for a snapshot)." << std::endl;
+        return false;
+    }
+    if (restoring && (reducing || !options.partialOutput.empty() || options.shardCount > 1 || options.quantiles > 0)) {
+        std::cerr << "A snapshot brings its own events and groups: no --reduce, --partial-output, --shard or "
+                  << "--quantiles with --restore." << std::endl;
+        return false;
+    }
+    if (options.bootstrapIterations > 0 && options.bootstrapSize <= 0) {
+        std::cerr << "Bootstrapping needs a sample size (--bootstrap-size)." << std::endl;
+        return false;
+    }
+    if (options.quantiles > 0 && (reducing || options.shardCount > 1)) {
+        std::cerr << "Quantile cuts would differ from shard to shard; use --thresholds with --shard and --reduce." << std::endl;
+        return false;
+    }
+    if (reducing && !options.abnormalReturnsOutput.empty()) {
+        std::cerr << "Per-event abnormal returns are written by each shard's run (--ar-output there)." << std::endl;
+        return false;
+    }
+    // A sweep fetches once at its widest window and reads every other
+    // combination off the same abnormal returns
+    bool sweeping = !options.sweepWindows.empty() || !options.sweepThresholds.empty();
+    if (sweeping && (reducing || restoring || !options.partialOutput.empty() || options.streamChunk > 0 ||
+                     options.quantiles > 0)) {
+        std::cerr << "A sweep needs every event's abnormal returns in one run: no --reduce, --restore, "
+                  << "--partial-output, --stream-chunk or --quantiles." << std::endl;
+        return false;
+    }
+    if (!options.snapshotOutput.empty() && (sweeping || !options.partialOutput.empty())) {
+        std::cerr << "A snapshot is of a finished analysis; --sweep and --partial-output runs don't report one." << std::endl;
+        return false;
+    }
+    std::vector<int> sweepWindows = options.sweepWindows;
+    if (sweepWindows.empty()) sweepWindows.push_back(options.window);
+    std::vector<std::pair<double, double>> sweepThresholds = options.sweepThresholds;
+    if (sweepThresholds.empty()) sweepThresholds.emplace_back(options.beatThreshold, options.missThreshold);
+    
+    std::string apiKey = options.apiKey;
+    if (apiKey.empty()) {
+        const char* environmentKey = std::getenv("ALPHAVANTAGE_API_KEY");
+        if (environmentKey) apiKey = environmentKey;
+    }
+    
+    StockAnalyzer analyzer(apiKey, options.cacheDir);
+    MarketData& marketData = analyzer.getMarketData();
+    marketData.setProvider(options.provider);
+    marketData.setMaxConcurrentRequests(options.maxConcurrent);
+    marketData.setRateLimit(options.requestsPerMinute);
+    marketData.setMaxRetries(options.maxRetries);
+    analyzer.setEventWindow(sweeping ? *std::max_element(sweepWindows.begin(), sweepWindows.end()) : options.window);
+    if (!analyzer.setReturnModel(options.returnModel, options.estimationFirst, options.estimationLast)) return false;
+    analyzer.setBootstrapThreads(options.bootstrapThreads);
+    analyzer.setBootstrapSeed(options.seed);
+    analyzer.setStreaming(options.streamChunk, options.streamRows);
+    analyzer.setExportFormat(options.exportFormat, options.exportPrecision);
+    analyzer.setShard(options.shardIndex, options.shardCount);
+    if (!analyzer.setSurpriseThresholds(options.beatThreshold, options.missThreshold)) return false;
+    bool streaming = options.streamChunk > 0;
+    if (streaming) analyzer.setStreamedReturnsOutput(options.abnormalReturnsOutput);
+    
+    if (restoring) {
+        // The snapshot brings its own window, model and groups
+        if (!analyzer.loadSnapshot(options.restoreInput)) return false;
+        if (!options.abnormalReturnsOutput.empty() && !analyzer.exportAbnormalReturns(options.abnormalReturnsOutput)) {
+            return false;
+        }
+    } else if (reducing) {
+        // The partial results bring their own window and groups
+        for (const std::string& filename : options.reduceInputs) {
+            if (!analyzer.mergePartial(filename)) return false;
+        }
+        if (!analyzer.allShardsMerged()) {
+            std::cerr << "Some shards' partial results are missing; the results would cover part of the input." << std::endl;
+            return false;
+        }
+    } else {
+        if (!analyzer.loadStockDataFromFile(options.input)) {
+            std::cerr << "No stocks loaded from " << options.input << std::endl;
+            return false;
+        }
+        // A shard can hold no symbols at all; its partial results are then empty
+        bool emptyShard = options.shardCount > 1 && analyzer.symbolCount() == 0;
+        // Streamed events can't be regrouped, so their quantiles come from the loaded surprises
+        if (streaming && options.quantiles > 0 && !analyzer.setQuantileGroups(options.quantiles)) return false;
+        if (!emptyShard && !analyzer.retrieveHistoricalData()) {
+            std::cerr << "No stock has abnormal returns to analyze." << std::endl;
+            return false;
+        }
+        if (!streaming && options.quantiles > 0 && !analyzer.setQuantileGroups(options.quantiles)) return false;
+        if (!streaming && !options.abnormalReturnsOutput.empty() &&
+            !analyzer.exportAbnormalReturns(options.abnormalReturnsOutput)) {
+            return false;
+        }
+        // A shard's run hands its groups to the reduce step instead of reporting them
+        if (!options.partialOutput.empty()) return analyzer.writePartial(options.partialOutput);
+        if (sweeping) return analyzer.exportSweep(sweepWindows, sweepThresholds, options.sweepOutput);
+    }
+    
+    if (!analyzer.exportCAAR(options.caarOutput)) return false;
+    if (options.bootstrapIterations > 0) {
+        if (!analyzer.performBootstrapping(options.bootstrapSize, options.bootstrapIterations, options.bootstrapOutput,
+                                           options.drawsOutput)) {
+            return false;
+        }
+    } else if (restoring && analyzer.hasBootstrap() && !analyzer.exportBootstrap(options.bootstrapOutput)) {
+        // A restored bootstrap is reported again without rerunning it
+        return false;
+    }
+    if (!options.snapshotOutput.empty() && !analyzer.saveSnapshot(options.snapshotOutput)) return false;
+    return true;
+}
+
+// Synthetic workloads for timing the hot paths without the network. Prices
+// are random walks on a weekday calendar; bodies use the Alpha Vantage
+// daily adjusted CSV layout, newest bar first.
+class Benchmark {
+private:
+    struct Result {
+        std::string stage;
+        int stocks;
+        int days;
+        int repetitions;
+        double seconds; // Per repetition
+        double items;   // Work items per repetition
+    };
+    
+    const BatchOptions& options;
+    std::vector<Result> results;
+    std::vector<std::pair<int, int>> skipped; // (stocks, days) over the memory budget
+    
+    static constexpr double MIN_SECONDS = 0.2;    // Repeat a stage until it has run this long
+    static constexpr int MARGIN_BARS = 10;        // Extra bars either side of each window
+    static constexpr int BODY_POOL = 16;          // Distinct CSV bodies, reused across stocks
+    static constexpr int BOOTSTRAP_SIZE = 40;
+    static constexpr int BOOTSTRAP_ITERATIONS = 1024;
+    static constexpr double BYTES_PER_CELL = 64;  // Segments and an analyzer's arena and group matrix, at peak
+    
+    // Uniform in [0, 1)
+    static double uniform(CounterRng& rng) {
+        return (rng.next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+    
+    // Weekdays from 2000-01-03 on
+    static std::vector<int> weekdays(size_t count) {
+        std::vector<int> dates;
+        int day;
+        parseDate("2000-01-03", day);
+        while (dates.size() < count) {
+            if ((day + 3) % 7 < 5) dates.push_back(day); // 1970-01-01 was a Thursday
+            day++;
+        }
+        return dates;
+    }
+    
+    // Random walk with about 1% daily moves
+    static PriceSeries randomWalk(const std::vector<int>& dates, CounterRng& rng) {
+        PriceSeries series;
+        series.dates = dates;
+        series.prices.resize(dates.size());
+        double price = 20.0 + 180.0 * uniform(rng);
+        for (double& value : series.prices) {
+            price *= 1.0 + 0.0346 * (uniform(rng) - 0.5);
+            value = price;
+        }
+        return series;
+    }
+    
+    static std::string csvBody(const PriceSeries& series) {
+        std::string body = "timestamp,open,high,low,close,adjusted_close,volume,dividend_amount,split_coefficient\n";
+        char line[160];
+        for (size_t i = series.dates.size(); i-- > 0;) {
+            double price = series.prices[i];
+            int length = std::snprintf(line, sizeof(line), "%s,%.4f,%.4f,%.4f,%.4f,%.4f,1000000,0.0000,1.0\n",
+                                       formatDate(series.dates[i]).c_str(), price, price * 1.01, price * 0.99,
+                                       price, price);
+            body.append(line, length);
+        }
+        return body;
+    }
+    
+    // Run a stage until MIN_SECONDS have passed and record its time per run
+    template <typename Stage>
+    void measure(const std::string& stage, int stocks, int days, double items, Stage run) {
+        int repetitions = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0.0;
+        do {
+            run();
+            repetitions++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < MIN_SECONDS);
+        results.push_back(Result{stage, stocks, days, repetitions, elapsed / repetitions, items});
+        std::cerr << "  " << stage << ": " << elapsed / repetitions * 1e3 << " ms" << std::endl;
+    }
+    
+    void runConfiguration(int stockCount, int days) {
+        int window = days / 2;
+        size_t bars = 2 * window + 2 + 2 * MARGIN_BARS;
+        std::vector<int> dates = weekdays(bars);
+        int earningsDay = dates[MARGIN_BARS + window + 1];
+        
+        TradingCalendar calendar;
+        calendar.build(dates);
+        CounterRng rng(1, static_cast<uint64_t>(stockCount) << 32 | days);
+        PriceSeries market = randomWalk(dates, rng);
+        std::vector<double> marketReturns(market.prices.size() - 1);
+        kernels().simpleReturns(market.prices.data(), marketReturns.size(), marketReturns.data());
+        
+        std::vector<PriceSeries> series;
+        std::vector<std::string> bodies;
+        EventStore events(window);
+        std::vector<PriceSegment> segments(stockCount);
+        const int length = 2 * window + 2;
+        for (int i = 0; i < stockCount; i++) {
+            double estimate = 0.5 + uniform(rng);
+            double actual = estimate * (0.8 + 0.4 * uniform(rng));
+            EventHandle h = events.add("S" + std::to_string(i), estimate, actual, earningsDay);
+            PriceSeries walk = randomWalk(dates, rng);
+            if (i < BODY_POOL) bodies.push_back(csvBody(walk));
+            segments[i].fill(walk, calendar, events.windowStart(h, calendar), length);
+        }
+        double cells = static_cast<double>(stockCount) * (2 * window + 1);
+        double rows = static_cast<double>(bars);
+        
+        measure("parse", stockCount, days, stockCount * rows, [&]() {
+            for (int i = 0; i < stockCount; i++) parsePrices(bodies[i % bodies.size()]);
+        });
+        
+        measure("returns", stockCount, days, cells, [&]() {
+            for (PriceSegment& segment : segments) {
+                segment.calculateReturns();
+                segment.calculateAbnormalReturns(marketReturns);
+            }
+        });
+        for (EventHandle h = 0; h < events.size(); h++) {
+            events.attach(h, events.appendSegment(segments[h]), segments[h].calendarStart);
+        }
+        
+        measure("group_add", stockCount, days, cells, [&]() {
+            Group group("All", &events, 0);
+            for (EventHandle h = 0; h < events.size(); h++) group.addEvent(h);
+            group.clear();
+        });
+        events.clearWindows(window);
+        
+        // The analyzer takes its own copy of the segments, after which they can go
+        StockAnalyzer analyzer("", "");
+        analyzer.setEventWindow(window);
+        for (EventHandle h = 0; h < events.size(); h++) {
+            analyzer.addAnalyzedEvent(events.symbol(h), events.epsEstimates[h], events.actualEPS[h], earningsDay, segments[h]);
+        }
+        std::vector<PriceSegment>().swap(segments);
+        
+        measure("aar_caar", stockCount, days, cells, [&]() { analyzer.calculateGroupMetrics(); });
+        
+        measure("bootstrap", stockCount, days, BOOTSTRAP_ITERATIONS, [&]() {
+            analyzer.bootstrapStatistics(BOOTSTRAP_SIZE, BOOTSTRAP_ITERATIONS, 1);
+        });
+        
+        // Parse, window, returns and grouping, as one fetched stock after
+        // another. The analyzer (and its connection pool) is set up once;
+        // each run starts from an empty one.
+        StockAnalyzer pipeline("", "");
+        pipeline.setEventWindow(window);
+        measure("pipeline", stockCount, days, stockCount, [&]() {
+            pipeline.clearEvents();
+            for (EventHandle h = 0; h < events.size(); h++) {
+                PriceSegment segment;
+                if (!segment.fill(parsePrices(bodies[h % bodies.size()]), calendar, events.windowStart(h, calendar), length)) continue;
+                segment.calculateReturns();
+                segment.calculateAbnormalReturns(marketReturns);
+                pipeline.addAnalyzedEvent(events.symbol(h), events.epsEstimates[h], events.actualEPS[h], earningsDay, segment);
+            }
+        });
+    }
+    
+    void write(std::ostream& out) const {
+        if (options.benchmarkFormat == "csv") {
+            out << "stage,stocks,days,repetitions,seconds,items_per_second\n";
+            for (const Result& result : results) {
+                out << result.stage << "," << result.stocks << "," << result.days << "," << result.repetitions << ","
+                    << result.seconds << "," << result.items / result.seconds << "\n";
+            }
+            for (const auto& configuration : skipped) {
+                out << "skipped," << configuration.first << "," << configuration.second << ",0,,\n";
+            }
+            return;
+        }
+        
+        out << "{\n  \"kernels\": \"" << kernels().name << "\",\n  \"threads\": "
+            << std::max(1u, std::thread::hardware_concurrency()) << ",\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& result = results[i];
+            out << (i ? "," : "") << "\n    {\"stage\": \"" << result.stage << "\", \"stocks\": " << result.stocks
+                << ", \"days\": " << result.days << ", \"repetitions\": " << result.repetitions
+                << ", \"seconds\": " << result.seconds << ", \"items_per_second\": " << result.items / result.seconds << "}";
+        }
+        out << "\n  ],\n  \"skipped\": [";
+        for (size_t i = 0; i < skipped.size(); i++) {
+            out << (i ? ", " : "") << "{\"stocks\": " << skipped[i].first << ", \"days\": " << skipped[i].second << "}";
+        }
+        out << "]\n}\n";
+    }
+    
+public:
+    explicit Benchmark(const BatchOptions& batchOptions) : options(batchOptions) {}
+    
+    // Time every stage at every configuration that fits the memory budget
+    bool run() {
+        for (int days : options.benchmarkDays) {
+            for (int stockCount : options.benchmarkStocks) {
+                double megabytes = static_cast<double>(stockCount) * (days + 1) * BYTES_PER_CELL / (1024 * 1024);
+                if (megabytes > options.benchmarkMemoryMB) {
+                    std::cerr << "Skipping " << stockCount << " stocks x " << days << " days: needs about "
+                              << static_cast<int>(megabytes) << " MB" << std::endl;
+                    skipped.emplace_back(stockCount, days);
+                    continue;
+                }
+                std::cerr << "Benchmarking " << stockCount << " stocks x " << days << " days" << std::endl;
+                runConfiguration(stockCount, days);
+            }
+        }
+        
+        if (options.benchmarkOutput.empty()) {
+            std::cout << std::setprecision(6);
+            write(std::cout);
+            return true;
+        }
+        std::ofstream file(options.benchmarkOutput);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file for writing: " << options.benchmarkOutput << std::endl;
+            return false;
+        }
+        write(file);
+        return static_cast<bool>(file);
+    }
+};
+
+int main(int argc, char* argv[]) {
+    // Command-line flags select batch mode
+    BatchOptions options;
+    bool batch = argc > 1;
+    if (batch) {
+        std::string first = argv[1];
+        if (first == "--help" || first == "-h") {
+            printUsage(argv[0]);
+            return 0;
+        }
+        if (!parseArguments(argc, argv, options)) {
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+    
     // Initialize CURL globally
     curl_global_init(CURL_GLOBAL_DEFAULT);
     
-    // Create and run the analyzer
-    StockAnalyzer analyzer("");
-    analyzer.runAnalysis();
+    // Create and run the analyzer; scoped so its pooled handles are
+    // released before the global cleanup
+    bool succeeded = true;
+    if (!options.benchmarkFormat.empty()) {
+        succeeded = Benchmark(options).run();
+    } else if (batch) {
+        succeeded = runBatch(options);
+    } else {
+        StockAnalyzer analyzer("");
+        analyzer.runAnalysis();
+    }
+    
+    // Report where the time went
+    if (options.benchmarkFormat.empty()) metrics().printSummary(std::cerr);
+    if (!options.metricsOutput.empty() && !metrics().write(options.metricsOutput, options.metricsFormat)) {
+        succeeded = false;
+    }
     
     // Cleanup CURL
     curl_global_cleanup();
     
-    return 0;
+    return succeeded ? 0 : 1;
 }